@@ -1,5 +1,6 @@
 #include <vector>
 #include <map>
+#include <mutex>
 #include <thread>
 #include <limits>
 #include <random>
@@ -20,7 +21,7 @@ typedef std::pair<int, int> intp_t;
 static std::vector<intp_t> ref_vals;
 static std::map<int, int> sorted_vals;
 static const int N = 1000000;
-static const int INIT = 0, RESTART = 1, SHORTCUT = 2;
+static const int INIT = 0, RESTART = 1, SHORTCUT = 2, SCALING = 3;
 
 void create_reference(int n) {
     std::mt19937 rng(112233L);
@@ -114,7 +115,33 @@ template <class Map> void run_remove(Map &vmap, const int n, const int r, const
     TIMER_STOP(t_remove, "remove " << r << " KV pairs, ref_start = " << ref_start);
 }
 
-template <class Map> void run_bench(Map &vmap, bool ephemeral, int bench_id, int N, int t) {
+template <class Map> struct is_vordered_kv : std::false_type {};
+template <typename K, typename V, typename P, bool S> struct is_vordered_kv<vordered_kv_t<K, V, P, S>> : std::true_type {};
+
+// the same store with a mutex-contended generator in front of every insert: rand_r behind one global mutex,
+// as the shared generator used to be drawn once per new node. Heights still come from the per-thread
+// generator, so this measures the cost of the contention, not the old code path as it was.
+template <class Map> class contended_generator_t : public Map {
+    inline static std::mutex rand_mutex;
+    inline static unsigned int rand_state = 0x123;
+public:
+    using Map::Map;
+    bool insert(int key, int value) {
+	{
+	    std::unique_lock<std::mutex> lock(rand_mutex);
+	    (void)rand_r(&rand_state);
+	}
+	return Map::insert(key, value);
+    }
+};
+
+template <class Map> double insert_throughput(Map &vmap, const int n, const int t) {
+    auto start = std::chrono::steady_clock::now();
+    run_insert(vmap, n, t);
+    return n / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Map> void run_bench(Map &vmap, bool ephemeral, int bench_id, int N, int t, const std::string &db = "") {
     if (bench_id == INIT) {
 	DBG("initial bench: insert, remove, insert");
 	run_insert(vmap, N, t);
@@ -135,29 +162,72 @@ template <class Map> void run_bench(Map &vmap, bool ephemeral, int bench_id, int
 	run_remove(vmap, N, int(std::trunc(N * 0.9)), t); // remove 90% of elements
 	if constexpr(std::is_same<Map, vordered_kv_t<int, int, pmem_history_t<int, int>, true>>::value
 		     || std::is_same<Map, vordered_kv_t<int, int, pmem_history_t<int, int>, false>>::value) {
+	    TIMER_START(t_scrub);
 	    vmap.scrub();
+	    TIMER_STOP(t_scrub, "stop-the-world scrub");
 	    vmap.clear_stats();
 	}
 	run_extract_find(vmap, N, 1, t);
+    } else if (bench_id == SCALING) {
+	DBG("scaling bench: insert throughput");
+	double after = insert_throughput(vmap, N, t);
+	DBG("insert throughput: " << (long)after << " ops/s, threads = " << t);
+	// same run, same thread count: a second store of the same type behind a mutex-contended generator
+	if constexpr(is_vordered_kv<Map>::value) {
+	    std::string contended_db = db + ".contended";
+	    std::filesystem::remove_all(contended_db);
+	    double contended;
+	    {
+		contended_generator_t<Map> contended_kv(contended_db);
+		contended = insert_throughput(contended_kv, N, t);
+	    }
+	    std::filesystem::remove_all(contended_db);
+	    DBG("insert throughput with a mutex-contended generator: " << (long)contended << " ops/s, ratio = "
+		<< after / contended << ", threads = " << t);
+	}
     } else
-	FATAL("no valid bench ID specified: INIT, RESTART, SHORTCUT");
+	FATAL("no valid bench ID specified: INIT, RESTART, SHORTCUT, SCALING");
+}
+
+// RESTART reopens the store left by INIT, which holds 2 * N keys, so the constructor times the restore
+void report_restore(int bench_id, std::chrono::steady_clock::time_point start, int N) {
+    if (bench_id != RESTART)
+	return;
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    DBG("restore throughput: " << (long)(2 * N / secs) << " keys/s");
 }
 
 void run_for_approach(const std::string &approach, int bench_id, int N, int t, const std::string &db, bool shared) {
     if (approach == "skiplist_t") {
         vordered_kv_t<int, int, emem_history_t<int, int>> map(db);
-	run_bench(map, true, bench_id, N, t);
+	run_bench(map, true, bench_id, N, t, db);
     } else if (approach == "locked_map_t") {
         locked_map_t<int, int> map;
         run_bench(map, true, bench_id, N, t);
     } else if (approach == "vordered_kv_t") {
+        auto start = std::chrono::steady_clock::now();
         vordered_kv_t<int, int, pmem_history_t<int, int>, false> map(db);
-	run_bench(map, false, bench_id, N, t);
-	DBG("stats: " << map.get_stats());
+	report_restore(bench_id, start, N);
+	run_bench(map, false, bench_id, N, t, db);
+	DBG("stats: " << map.get_stats(false, true));
     } else if (approach == "vordered_kv_t_scut") {
+        auto start = std::chrono::steady_clock::now();
         vordered_kv_t<int, int, pmem_history_t<int, int>, true> map(db);
-	run_bench(map, false, bench_id, N, t);
-	DBG("stats: " << map.get_stats());
+	report_restore(bench_id, start, N);
+	run_bench(map, false, bench_id, N, t, db);
+	DBG("stats: " << map.get_stats(false, true));
+    } else if (approach == "vordered_kv_t_mmap") {
+        auto start = std::chrono::steady_clock::now();
+        vordered_kv_t<int, int, mmap_history_t<int, int>, true> map(db);
+	report_restore(bench_id, start, N);
+	run_bench(map, false, bench_id, N, t, db);
+	DBG("stats: " << map.get_stats(false, true));
+    } else if (approach == "vordered_kv_t_wal") {
+        auto start = std::chrono::steady_clock::now();
+        vordered_kv_t<int, int, wal_history_t<int, int>, true> map(db);
+	report_restore(bench_id, start, N);
+	run_bench(map, false, bench_id, N, t, db);
+	DBG("stats: " << map.get_stats(false, true));
     } else if (approach == "sqlite_wrapper_t") {
         sqlite_wrapper_t map(db, t, shared);
 	run_bench(map, false, bench_id, N, t);
@@ -165,7 +235,7 @@ void run_for_approach(const std::string &approach, int bench_id, int N, int t, c
 	rocksdb_wrapper_t<int, int> map(db);
 	run_bench(map, false, bench_id, N, t);
     } else
-        FATAL("no valid approach selected: skiptlist_t, locked_map_t, pskiplist_t, sqlitewrapper_t, rocksdb_wrapper_t");
+        FATAL("no valid approach selected: skiptlist_t, locked_map_t, pskiplist_t, vordered_kv_t_mmap, vordered_kv_t_wal, sqlitewrapper_t, rocksdb_wrapper_t");
 }
 
 int main(int argc, char **argv) {
@@ -186,8 +256,10 @@ int main(int argc, char **argv) {
 	    run_for_approach(approach, RESTART, N, t, db, shared);
 	} else if (suite.compare("shortcut") == 0)
 	    run_for_approach(approach, SHORTCUT, N, t, db, shared);
+	else if (suite.compare("scaling") == 0)
+	    run_for_approach(approach, SCALING, N, t, db, shared);
 	else
-	    FATAL("no valid suite selected: standard, shortcut");
+	    FATAL("no valid suite selected: standard, shortcut, scaling");
         std::filesystem::remove_all(db);
     }
 
@@ -0,0 +1,171 @@
+#ifndef __ARENA
+#define __ARENA
+
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+
+// Cache-line aligned bump allocator with per-size free lists. Every thread allocates from its own heap,
+// picked by a dense thread id, so that threads do not contend. Chunks are CHUNK aligned and start with a
+// line naming the heap they were carved for: a block freed by another thread (the maintainer, reclaim())
+// is pushed to the remote list of that heap and reused by its thread once the local lists run dry,
+// instead of piling up on the thread that freed it.
+class arena_t {
+    static const size_t LINE = 64, CHUNK = 1 << 20, HEAPS = 256;
+
+    // a block on a remote list
+    struct block_t {
+        block_t *next;
+        size_t lines;
+    };
+
+    struct alignas(64) heap_t {
+        // uncontended unless more than HEAPS threads are alive and share a heap
+        std::mutex mutex;
+        char *curr = nullptr, *end = nullptr;
+        std::vector<std::vector<void *>> free_lists;
+        std::atomic<block_t *> remote{nullptr};
+    };
+
+    struct chunk_t {
+        heap_t *owner;
+    };
+
+    std::atomic<heap_t *> heaps[HEAPS] = {};
+    std::vector<void *> chunks;
+    std::mutex chunk_mutex;
+
+    inline static std::mutex id_mutex;
+    inline static std::vector<size_t> free_ids;
+    inline static size_t next_id = 0;
+
+    // dense thread ids, handed back when a thread exits so that the next thread takes over its heaps
+    static size_t thread_id() {
+        struct id_t {
+            size_t id;
+            id_t() {
+                std::unique_lock<std::mutex> lock(id_mutex);
+                if (free_ids.empty())
+                    id = next_id++;
+                else {
+                    id = free_ids.back();
+                    free_ids.pop_back();
+                }
+            }
+            ~id_t() {
+                std::unique_lock<std::mutex> lock(id_mutex);
+                free_ids.push_back(id);
+            }
+        };
+        static thread_local id_t slot;
+        return slot.id;
+    }
+
+    heap_t &local_heap() {
+        std::atomic<heap_t *> &slot = heaps[thread_id() % HEAPS];
+        heap_t *heap = slot.load();
+        if (heap == nullptr) {
+            heap_t *fresh = new heap_t();
+            if (slot.compare_exchange_strong(heap, fresh))
+                heap = fresh;
+            else
+                delete fresh;
+        }
+        return *heap;
+    }
+
+    static heap_t *owner(void *ptr) {
+        return ((chunk_t *)((uintptr_t)ptr & ~(uintptr_t)(CHUNK - 1)))->owner;
+    }
+
+    char *new_chunk(heap_t &heap, size_t size) {
+        void *chunk = std::aligned_alloc(CHUNK, size);
+        if (chunk == nullptr)
+            throw std::bad_alloc();
+        ((chunk_t *)chunk)->owner = &heap;
+        std::unique_lock<std::mutex> lock(chunk_mutex);
+        chunks.push_back(chunk);
+        return (char *)chunk + LINE;
+    }
+
+    // the callers below hold heap.mutex
+    static void push(heap_t &heap, void *ptr, size_t n) {
+        if (n >= heap.free_lists.size())
+            heap.free_lists.resize(n + 1);
+        heap.free_lists[n].push_back(ptr);
+    }
+    static void *pop(heap_t &heap, size_t n) {
+        if (n >= heap.free_lists.size() || heap.free_lists[n].empty())
+            return nullptr;
+        void *ptr = heap.free_lists[n].back();
+        heap.free_lists[n].pop_back();
+        return ptr;
+    }
+    // moves the blocks freed by other threads to the local lists
+    static void drain(heap_t &heap) {
+        block_t *block = heap.remote.exchange(nullptr);
+        while (block != nullptr) {
+            block_t *next = block->next;
+            push(heap, block, block->lines);
+            block = next;
+        }
+    }
+
+public:
+    arena_t() = default;
+    arena_t(const arena_t &) = delete;
+    ~arena_t() {
+        for (auto chunk : chunks)
+            std::free(chunk);
+        for (auto &heap : heaps)
+            delete heap.load();
+    }
+
+    static size_t lines(size_t size) {
+        return (size + LINE - 1) / LINE;
+    }
+
+    void *allocate(size_t size) {
+        size_t n = lines(size);
+        heap_t &heap = local_heap();
+        std::unique_lock<std::mutex> lock(heap.mutex);
+        void *ptr = pop(heap, n);
+        if (ptr == nullptr && heap.remote.load() != nullptr) {
+            drain(heap);
+            ptr = pop(heap, n);
+        }
+        if (ptr != nullptr)
+            return ptr;
+        // blocks that do not fit a chunk after its owner line get a chunk of their own
+        if ((n + 1) * LINE > CHUNK)
+            return new_chunk(heap, ((n + 1) * LINE + CHUNK - 1) / CHUNK * CHUNK);
+        if (heap.curr + n * LINE > heap.end) {
+            heap.curr = new_chunk(heap, CHUNK);
+            heap.end = heap.curr - LINE + CHUNK;
+        }
+        ptr = heap.curr;
+        heap.curr += n * LINE;
+        return ptr;
+    }
+
+    // memory goes back to the heap it was carved for: to its free lists when freed by its own thread,
+    // to its remote list otherwise. Chunks are released with the arena.
+    void deallocate(void *ptr, size_t size) {
+        size_t n = lines(size);
+        heap_t *heap = owner(ptr);
+        if (heap == &local_heap()) {
+            std::unique_lock<std::mutex> lock(heap->mutex);
+            push(*heap, ptr, n);
+            return;
+        }
+        block_t *block = (block_t *)ptr;
+        block->lines = n;
+        block->next = heap->remote.load();
+        while (!heap->remote.compare_exchange_weak(block->next, block));
+    }
+};
+
+#endif // __ARENA
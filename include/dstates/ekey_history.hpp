@@ -1,228 +1,236 @@
-
 #ifndef __EKEY_HISTORY_T
 #define __EKEY_HISTORY_T
 
 #include "marker.hpp"
 #include "key_info.hpp"
+#include "simd_search.hpp"
 #include <atomic>
-#include <vector>
+#include <limits>
 #include <algorithm>
-#include <shared_mutex>
+#include <vector>
+#include <mutex>
 
 template <class V>
 class ekey_history_t {
-    static const size_t BLOCK_SIZE = 128;
-
-    struct entry_t {
-        int ts;
-        V val;
-        bool marked = false;
-        // entry_t() : ts(-1), val(marker_t<V>::low_marker) {}
-    };
+    static const size_t BLOCK_SIZE = 128, SEGMENTS = 48;
 
-    struct block_index_entry {
-        int timestamp; // starting timestamp of this block
-        std::vector<entry_t> entries;
-        block_index_entry(int ts) : timestamp(ts), entries(BLOCK_SIZE) {}
+    // structure of arrays, so that the version search scans a dense run of timestamps
+    struct block_t {
+        alignas(64) version_t ts[BLOCK_SIZE];
+        V vals[BLOCK_SIZE];
+        std::atomic<bool> marked[BLOCK_SIZE] = {}; // marked[i] is published once ts[i] and vals[i] are written
     };
-
-    // Rather than having a pair of timestamps, it's a vector of structs having timestamp and vector of entries.
-    std::vector<block_index_entry> block_index;
-    std::shared_mutex block_index_mutex;
-    std::atomic<size_t>tail{0}, pending{0}; // has to be atomic, becuase it is shared among threads.
-    int block_len = 0;
-    int max_timestamp = -1;
-    std::function<int()> tag_function;
-public:
-    key_info_t info;
-
-
-    ekey_history_t(std::function<int()> tag_fn = nullptr) : pending(0), tag_function(tag_fn) {
-        // unique lock cause the mutex is not shared with other threads, we are adding a new block.
-        std::unique_lock lock(block_index_mutex);
-        block_index.emplace_back(0); // First block starts with timestamp 0, but no entry has been made yet.
-        block_len = 1;
+    typedef std::atomic<block_t *> slot_t;
+
+    // Append-only block directory: segment k holds 2^k block slots, so blocks never move once
+    // published and the directory never needs to be reallocated. Readers take no locks.
+    std::atomic<slot_t *> directory[SEGMENTS] = {};
+    // pending: next slot to reserve, tail: end of the fully written prefix, first: first entry not truncated
+    std::atomic<size_t> tail{0}, pending{0}, first{0};
+    std::vector<block_t *> retired;
+    std::mutex retire_mutex;
+
+    static size_t segment_of(size_t b) {
+        return 63 - __builtin_clzll(b + 1);
     }
 
-    void set_tag_function(std::function<int()> tag_fn) {
-        tag_function = tag_fn;
+    template <class T> static T *publish(std::atomic<T *> &slot, T *fresh) {
+        T *expected = nullptr;
+        if (slot.compare_exchange_strong(expected, fresh))
+            return fresh;
+        delete fresh;
+        return expected;
     }
 
-    void insert(const V &v, bool flag)
-    {
-        size_t new_slot;
-        int t = 0;
-        auto &last_block = block_index.back();
-        {
-            std::unique_lock lock(block_index_mutex);
-            if (flag) {
-                t = tag_function();
+    block_t *get_block(size_t b, bool create = false) {
+        size_t k = segment_of(b), offset = b + 1 - (1UL << k);
+        slot_t *segment = directory[k].load();
+        if (segment == nullptr) {
+            if (!create)
+                return nullptr;
+            segment = new slot_t[1UL << k]();
+            slot_t *expected = nullptr;
+            if (!directory[k].compare_exchange_strong(expected, segment)) {
+                delete[] segment;
+                segment = expected;
             }
-            new_slot = pending.fetch_add(1); // Atomically increment pending and get the previous value
         }
-        
-        int index = new_slot % BLOCK_SIZE;      // Calculate the index within the block based on pending
-        int block_number = new_slot / BLOCK_SIZE;
-
-        if (new_slot >= block_len * BLOCK_SIZE)
-        {
-            std::unique_lock lock(block_index_mutex);
-            for (int i = block_len; i <= block_number; i++)
-            {
-                block_index.emplace_back(100000000);
-                block_len++;
-            }
-        }
-
-        block_index[block_number].timestamp = std::min(last_block.timestamp, t); // it might not happen that the first entry will reach the block first.
-        block_index[block_number].entries[index].ts = t;
-        block_index[block_number].entries[index].val = v;
-        block_index[block_number].entries[index].marked = true;
+        block_t *block = segment[offset].load();
+        if (block == nullptr && create)
+            block = publish(segment[offset], new block_t());
+        return block;
     }
 
-    void remove(int t) {
-        insert(t, marker_t<V>::low_marker);
+    // advances the tail over the entries written in the meantime and returns it
+    size_t committed() {
+        size_t current = tail.load();
+        while (true) {
+            block_t *block = get_block(current / BLOCK_SIZE);
+            if (block == nullptr || !block->marked[current % BLOCK_SIZE].load())
+                return current;
+            size_t next = current + 1;
+            if (tail.compare_exchange_weak(current, next))
+                current = next;
+        }
     }
 
+    // first index in [start, end) with a timestamp > t: a binary search over the first timestamp of
+    // each block picks the block, count_le() finishes inside it. Truncated blocks count as older than any t.
+    size_t upper(version_t t, size_t start, size_t end) {
+        if (start >= end)
+            return start;
+        size_t left = start / BLOCK_SIZE, right = (end - 1) / BLOCK_SIZE + 1, lowest = left;
+        while (left < right) {
+            size_t middle = (left + right) / 2;
+            block_t *block = get_block(middle);
+            if (block == nullptr || block->ts[std::max(start, middle * BLOCK_SIZE) % BLOCK_SIZE] <= t)
+                left = middle + 1;
+            else
+                right = middle;
+        }
+        if (left == lowest)
+            return start;
+        size_t b = left - 1, begin = std::max(start, b * BLOCK_SIZE), stop = std::min(end, (b + 1) * BLOCK_SIZE);
+        block_t *block = get_block(b);
+        if (block == nullptr)
+            return stop;
+        return begin + count_le(block->ts + begin % BLOCK_SIZE, stop - begin, t);
+    }
 
+    // block holding the newest committed entry with timestamp <= t and its offset, nullptr if none
+    block_t *locate(version_t t, size_t &offset) {
+        size_t start = first.load(), i = upper(t, start, committed());
+        if (i == start)
+            return nullptr;
+        offset = (i - 1) % BLOCK_SIZE;
+        return get_block((i - 1) / BLOCK_SIZE);
+    }
 
-    V find(int t){
-    
-    // If block_index is empty, return low marker
-    if (block_index.empty())
-        return marker_t<V>::low_marker;
-
-    size_t current_tail = tail.load(); // points to the one more than the last marked entry.
-
-    while (true) {
-        size_t block_number = current_tail / BLOCK_SIZE;
-        size_t index_in_block = current_tail % BLOCK_SIZE;
-
-        if (block_number >= block_len) {
-            break; // No more blocks
+    // calls f(ts, value) for the entries in [begin, end) up to the first one newer than to
+    template <typename F> void scan(size_t begin, size_t end, version_t to, F &&f) {
+        for (size_t i = begin; i < end; ) {
+            block_t *block = get_block(i / BLOCK_SIZE);
+            size_t stop = std::min(end, (i / BLOCK_SIZE + 1) * BLOCK_SIZE);
+            for (; block != nullptr && i < stop; i++) {
+                size_t offset = i % BLOCK_SIZE;
+                if (block->ts[offset] > to)
+                    return;
+                f(block->ts[offset], get_view(block->vals[offset]));
+            }
+            i = stop;
         }
+    }
 
-        const auto& current_block = block_index[block_number];
-        if (index_in_block >= current_block.entries.size()) {
-            break; // Reached the end of entries
+    void release_all() {
+        for (size_t k = 0; k < SEGMENTS; k++) {
+            slot_t *segment = directory[k].exchange(nullptr);
+            if (segment == nullptr)
+                continue;
+            for (size_t i = 0; i < (1UL << k); i++)
+                delete segment[i].load();
+            delete[] segment;
         }
+        purge();
+    }
 
-        const auto& entry = current_block.entries[index_in_block];
+public:
+    key_info_t info;
 
-        if (entry.ts <= t && entry.marked) {
-            size_t expected = current_tail;
-            if (tail.compare_exchange_weak(expected, current_tail + 1)) {
-                ++current_tail;
-                continue; // Proceed to the next entry
-            } else {
-                current_tail = tail.load(); // Reload if CAS failed
-            }
-        } else {
-            break; // Entry doesn't satisfy conditions
-        }
+    ekey_history_t() { }
+    ekey_history_t(const ekey_history_t &) = delete;
+    ~ekey_history_t() {
+        release_all();
     }
-    
-    if (current_tail == 0)
-        return marker_t<V>::low_marker;
-    current_tail -= 1; // points to the last marked entry
-    size_t block_number = current_tail / BLOCK_SIZE;
-    int index_in_block = current_tail % BLOCK_SIZE;
 
-    const auto& last_block = block_index[block_number];
-    const auto& tail_entry = last_block.entries[index_in_block];
-    // If the timestamp is the last valid entry
-    if (tail_entry.marked && tail_entry.ts <= t) {
-        return tail_entry.val;
+    // wait-free slot reservation, the block is allocated and published by whoever needs it first
+    void insert(version_t t, const V &v) {
+        size_t slot = pending.fetch_add(1), offset = slot % BLOCK_SIZE;
+        block_t *block = get_block(slot / BLOCK_SIZE, true);
+        block->ts[offset] = t;
+        block->vals[offset] = v;
+        block->marked[offset].store(true);
+        info.update(t, v == marker_t<V>::low_marker);
     }
 
-    auto block_it = std::upper_bound(block_index.begin(), block_index.end(), t,
-        [](int timestamp, const block_index_entry& entry) {
-            return timestamp < entry.timestamp;
-        }
-    );
-
-    if (block_it != block_index.begin())
-        --block_it;
-    else
-        return marker_t<V>::low_marker;
-
-    // Now search within the block
-    const auto& target_block = *block_it;
-    const auto& entries = target_block.entries;
-    
-
-    // Find the entry with greatest timestamp <= t
-    auto entry_it = std::upper_bound(entries.begin(), entries.end(), t,
-        [](int timestamp, const entry_t& entry) {
-            return timestamp < entry.ts;
-        }
-    );
-    
-    if (entry_it != entries.begin())
-        --entry_it;
-    else
-        return marker_t<V>::low_marker;
-    // Check if the entry is marked and timestamp <= t
-    if (entry_it->marked && entry_it->ts <= t) {
-        return entry_it->val;
+    void remove(version_t t) {
+        insert(t, marker_t<V>::low_marker);
     }
 
-    return marker_t<V>::low_marker;
-}
+    V find(version_t t) {
+        size_t offset;
+        block_t *block = locate(t, offset);
+        return block == nullptr ? marker_t<V>::low_marker : block->vals[offset];
+    }
 
+    // calls f(value) if a value is visible at version t
+    template <typename F> void visit(version_t t, F &&f) {
+        size_t offset;
+        block_t *block = locate(t, offset);
+        if (block != nullptr && block->vals[offset] != marker_t<V>::low_marker)
+            f(get_view(block->vals[offset]));
+    }
 
-void copy_to(std::vector<std::pair<int, V>>& result) {
-    std::shared_lock lock(block_index_mutex);
-    if (block_index.empty()) {
-        return;
+    // calls f(ts, value) for every committed entry in place, without materializing the history
+    template <typename F> void for_each(F &&f) {
+        scan(first.load(), committed(), std::numeric_limits<version_t>::max(), f);
     }
-    size_t total_entries = pending.load();
-    size_t current_tail = tail.load();
 
-    for (size_t idx = 0; idx < total_entries; idx++) {
-        size_t block_number = idx / BLOCK_SIZE;
-        size_t index_in_block = idx % BLOCK_SIZE;
+    // same as for_each, restricted to the entries with from <= ts <= to: seeks to from by binary search
+    template <typename F> void for_each(version_t from, version_t to, F &&f) {
+        size_t start = first.load(), end = committed();
+        if (from > std::numeric_limits<version_t>::min())
+            start = upper(from - 1, start, end);
+        scan(start, end, to, f);
+    }
 
-        if (block_number >= block_len) 
-            break; // No more blocks
+    template <typename T> void copy_to(std::vector<std::pair<T, V>> &result) {
+        for_each([&](version_t ts, const auto &val) {
+            result.emplace_back(ts, val);
+        });
+    }
 
-        const auto& current_block = block_index[block_number];
-        const auto& entry = current_block.entries[index_in_block];
+    template <typename T> void copy_to(version_t from, version_t to, std::vector<std::pair<T, V>> &result) {
+        for_each(from, to, [&](version_t ts, const auto &val) {
+            result.emplace_back(ts, val);
+        });
+    }
 
-        if (idx < current_tail) {
-            // Entries before tail: simply emplace into result
-            if (entry.marked) {
-                result.emplace_back(entry.ts, entry.val);
-            }
-        } else {
-            // Entries at or after tail
-            if (entry.marked) {
-                size_t expected_tail = current_tail;
-                if (tail.compare_exchange_weak(expected_tail, current_tail + 1)) {
-                    ++current_tail;
-                    result.emplace_back(entry.ts, entry.val);
-                } else {
-                    current_tail = tail.load();
-                }
-            } else 
-                break;
+    // drops the entries older than the newest committed entry at or below t. Only the first index moves,
+    // the blocks left entirely below it are unlinked: lock-free readers may still hold them, so they are
+    // only freed by purge().
+    size_t truncate_before(version_t t) {
+        std::unique_lock<std::mutex> lock(retire_mutex);
+        size_t begin = first.load(), i = upper(t, begin, committed());
+        if (i <= begin + 1)
+            return 0;
+        size_t keep = i - 1;
+        first.store(keep);
+        for (size_t b = begin / BLOCK_SIZE; b < keep / BLOCK_SIZE; b++) {
+            size_t k = segment_of(b);
+            retired.push_back(directory[k].load()[b + 1 - (1UL << k)].exchange(nullptr));
         }
+        return keep - begin;
     }
-}
 
+    // releases the blocks dropped by truncate_before, once no reader can access them anymore
+    void purge() {
+        std::unique_lock<std::mutex> lock(retire_mutex);
+        for (auto block : retired)
+            delete block;
+        retired.clear();
+    }
 
+    // releases all memory, no concurrent access allowed
     void cleanup() {
-        std::unique_lock lock(block_index_mutex);
-        block_index.clear();
-        // block_index.emplace_back(std::numeric_limits<int>::min());
+        release_all();
         pending.store(0);
         tail.store(0);
+        first.store(0);
     }
 
     size_t size() {
-        return pending.load();
+        return pending.load() - first.load();
     }
-
 };
 
 #endif // __EKEY_HISTORY_T
@@ -4,6 +4,7 @@
 #include "ekey_history.hpp"
 
 #include <memory>
+#include <vector>
 #include <functional>
 
 template <typename K, typename V> class emem_history_t {
@@ -11,23 +12,37 @@ public:
     typedef ekey_history_t<V> log_t;
     typedef log_t* plog_t;
 
-    emem_history_t(const std::string &db) { }
+    emem_history_t(const std::string &db, size_t pool_size = 0) { }
     ~emem_history_t() { }
-    int restore(std::function<bool (const K &, const V &, plog_t)> inserter) {
+    version_t restore(std::function<void (const K &, plog_t)> appender) {
 	return 0;
     }
+    plog_t lookup(const K &key) {
+	return nullptr;
+    }
+    void release_lookup() { }
+    bool load_index(std::function<void (const K &, plog_t, int)> appender, version_t &version) {
+	return false;
+    }
+    void save_index(version_t version, std::function<void (std::function<void (const K &, plog_t, int)>)> walk) { }
+    void tag(version_t version) { }
+    long transactions() {
+	return 0;
+    }
+    void clear_transactions() { }
     // creates new ekey_history object and calls any ekey_history constructor if any
     plog_t allocate() {
 	return new log_t();
     }
-    // void deallocate(plog_t ptr, bool cleanup = false) {
-	// delete ptr;
-    // }
     void deallocate(plog_t ptr, bool cleanup = false) {
-    if (cleanup && ptr) {
-        ptr->cleanup();
+	delete ptr;
+    }
+    void reclaim(const std::vector<plog_t> &logs) {
+	for (auto log : logs)
+	    delete log;
     }
-    delete ptr;
+    void batch(std::function<void ()> fn) {
+	fn();
     }
     void append(const K &key, plog_t kh) { }
 };
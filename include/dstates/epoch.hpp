@@ -0,0 +1,53 @@
+#ifndef __EPOCH
+#define __EPOCH
+
+#include <atomic>
+#include <thread>
+#include <functional>
+
+// Epoch-based reclamation: readers announce themselves in a per-thread slot, using the counter
+// that matches the parity of the global epoch. synchronize() flips the epoch twice and waits for
+// the old parity to drain each time, so every reader that was active when it was called is gone.
+class epoch_t {
+    static const size_t SLOTS = 64;
+
+    struct alignas(64) slot_t {
+        std::atomic<long> active[2] = {0, 0};
+    };
+
+    std::atomic<unsigned int> global{0};
+    slot_t slots[SLOTS];
+
+    static size_t thread_slot() {
+        static thread_local size_t slot = std::hash<std::thread::id>()(std::this_thread::get_id()) % SLOTS;
+        return slot;
+    }
+
+    std::atomic<long> &enter() {
+        std::atomic<long> &counter = slots[thread_slot()].active[global.load() & 1];
+        counter++;
+        return counter;
+    }
+
+public:
+    class guard_t {
+        std::atomic<long> &counter;
+    public:
+        guard_t(epoch_t &epoch) : counter(epoch.enter()) { }
+        ~guard_t() {
+            counter--;
+        }
+    };
+
+    // must not be called while the calling thread holds a guard
+    void synchronize() {
+        for (int i = 0; i < 2; i++) {
+            unsigned int parity = global.fetch_add(1) & 1;
+            for (size_t j = 0; j < SLOTS; j++)
+                while (slots[j].active[parity].load() != 0)
+                    std::this_thread::yield();
+        }
+    }
+};
+
+#endif // __EPOCH
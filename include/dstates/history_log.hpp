@@ -0,0 +1,263 @@
+#ifndef __HISTORY_LOG
+#define __HISTORY_LOG
+
+#include "ekey_history.hpp"
+#include "serializer.hpp"
+
+#include <atomic>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+// Common part of the history providers that keep the histories in memory as ekey_history_t and
+// persist them as a log of records: every update is encoded as a record and handed to commit(),
+// which must make it durable before returning. On open, the subclass hands the records it finds
+// to replay() in the order they were committed and calls recover() once done.
+template <typename K, typename V> class history_log_t {
+protected:
+    // payloads start with their type: KEY (id, key), VALUE (id, version, value), DROP (id),
+    // TRUNCATE (id, version), TAG (version), GROUP (a sequence of length-prefixed payloads written by batch())
+    enum : char { KEY = 'K', VALUE = 'V', DROP = 'D', TRUNCATE = 'T', TAG = 'C', GROUP = 'G' };
+    static constexpr size_t COMPACT_MIN = 4096; // smaller logs are replayed as they are
+
+public:
+    class log_t : public ekey_history_t<V> {
+	history_log_t *owner;
+	uint64_t id;
+
+    public:
+	log_t(history_log_t *owner, uint64_t id) : owner(owner), id(id) { }
+
+	uint64_t get_id() {
+	    return id;
+	}
+	void insert(version_t t, const V &v) {
+	    owner->write(VALUE, id, t, v);
+	    // inside batch(), the entry shows in memory only once the group is committed
+	    if (batching == owner)
+		deferred.emplace_back([this, t, v] { ekey_history_t<V>::insert(t, v); });
+	    else
+		ekey_history_t<V>::insert(t, v);
+	}
+	void remove(version_t t) {
+	    insert(t, marker_t<V>::low_marker);
+	}
+	size_t truncate_before(version_t t) {
+	    size_t dropped = ekey_history_t<V>::truncate_before(t);
+	    if (dropped > 0)
+		owner->write(TRUNCATE, id, t);
+	    return dropped;
+	}
+    };
+    typedef log_t* plog_t;
+
+private:
+    struct recovered_t {
+	bool named = false, dropped = false;
+	K key;
+	version_t truncated = std::numeric_limits<version_t>::min();
+	std::vector<std::pair<version_t, V>> entries;
+    };
+
+    std::atomic<uint64_t> next_id{0};
+    std::unordered_map<uint64_t, recovered_t> replayed;
+    std::vector<std::pair<K, plog_t>> recovered; // live histories found on open, sorted by key
+    version_t recovered_version = 0;
+    size_t replayed_records = 0, live_records = 0;
+
+    inline static thread_local history_log_t *batching = nullptr;
+    inline static thread_local std::vector<char> group;
+    inline static thread_local std::vector<std::function<void ()>> deferred;
+
+    template <typename... T> void write(char type, const T &...fields) {
+	std::vector<char> payload;
+	serialize(payload, type);
+	(serialize(payload, fields), ...);
+	if (batching == this) {
+	    serialize(group, (uint32_t)payload.size());
+	    group.insert(group.end(), payload.begin(), payload.end());
+	} else
+	    commit(payload);
+    }
+
+protected:
+    virtual void commit(const std::vector<char> &payload) = 0;
+
+    void replay(const char *p, size_t size) {
+	const char *end = p + size;
+	char type;
+	uint64_t id;
+	p = deserialize(p, type);
+	replayed_records += type != GROUP;
+	if (type == GROUP) {
+	    while (p < end) {
+		uint32_t length;
+		p = deserialize(p, length);
+		replay(p, length);
+		p += length;
+	    }
+	    return;
+	}
+	if (type == TAG) {
+	    version_t t;
+	    deserialize(p, t);
+	    recovered_version = std::max(recovered_version, t);
+	    return;
+	}
+	p = deserialize(p, id);
+	next_id = std::max(next_id.load(), id + 1);
+	recovered_t &log = replayed[id];
+	if (type == KEY) {
+	    deserialize(p, log.key);
+	    log.named = true;
+	} else if (type == VALUE) {
+	    version_t t;
+	    V v;
+	    deserialize(deserialize(p, t), v);
+	    log.entries.emplace_back(t, v);
+	} else if (type == DROP)
+	    log.dropped = true;
+	else if (type == TRUNCATE) {
+	    version_t t;
+	    deserialize(p, t);
+	    log.truncated = std::max(log.truncated, t);
+	}
+    }
+
+    // rebuilds the histories of the keys bound and not dropped by the replayed records
+    void recover() {
+	std::vector<std::pair<uint64_t, recovered_t *>> live;
+	for (auto &e : replayed)
+	    if (e.second.named && !e.second.dropped)
+		live.emplace_back(e.first, &e.second);
+	// a key reclaimed and inserted again right before a crash can have two live ids, the newer one wins
+	std::sort(live.begin(), live.end(), [](const auto &a, const auto &b) {
+	    return a.second->key < b.second->key || (a.second->key == b.second->key && a.first < b.first);
+	});
+	for (size_t i = 0; i < live.size(); i++) {
+	    if (i + 1 < live.size() && live[i + 1].second->key == live[i].second->key)
+		continue;
+	    recovered_t &log = *live[i].second;
+	    std::stable_sort(log.entries.begin(), log.entries.end(), [](const auto &a, const auto &b) {
+		return a.first < b.first;
+	    });
+	    // keeps the newest entry at or below the truncation version and everything after it
+	    size_t first = 0;
+	    while (first + 1 < log.entries.size() && log.entries[first + 1].first <= log.truncated)
+		first++;
+	    plog_t history = new log_t(this, live[i].first);
+	    for (size_t j = first; j < log.entries.size(); j++)
+		history->ekey_history_t<V>::insert(log.entries[j].first, log.entries[j].second);
+	    recovered_version = std::max(recovered_version, history->info.latest_version());
+	    recovered.emplace_back(log.key, history);
+	    live_records += 1 + log.entries.size() - first;
+	}
+	replayed.clear();
+    }
+
+    // most of the replayed records are overwritten by the live ones or belong to dropped keys
+    bool worth_compacting() {
+	return replayed_records > std::max<size_t>(2 * live_records, COMPACT_MIN);
+    }
+
+    // calls emit(payload) with the records that rebuild the recovered histories and version, so that
+    // a subclass can replace the log it replayed by a compacted one. Histories keep their ids.
+    void compact(std::function<void (const std::vector<char> &)> emit) {
+	std::vector<char> payload;
+	auto record = [&](char type, const auto &...fields) {
+	    payload.clear();
+	    serialize(payload, type);
+	    (serialize(payload, fields), ...);
+	    emit(payload);
+	};
+	for (auto &e : recovered) {
+	    record(KEY, e.second->get_id(), e.first);
+	    e.second->for_each([&](version_t t, const auto &v) {
+		record(VALUE, e.second->get_id(), t, V(v));
+	    });
+	}
+	record(TAG, recovered_version);
+	replayed_records = live_records + 1;
+    }
+
+public:
+    virtual ~history_log_t() { }
+
+    version_t restore(std::function<void (const K &, plog_t)> appender) {
+	for (auto &e : recovered)
+	    appender(e.first, e.second);
+	return recovered_version;
+    }
+    // slow path while the index is restored in the background, answered from the recovered histories
+    plog_t lookup(const K &key) {
+	auto it = std::lower_bound(recovered.begin(), recovered.end(), key, [](const auto &e, const K &k) {
+	    return e.first < k;
+	});
+	return it != recovered.end() && it->first == key ? it->second : nullptr;
+    }
+    // the index owns the histories now and no lookup runs anymore
+    void release_lookup() {
+	recovered.clear();
+	recovered.shrink_to_fit();
+    }
+    // the log is replayed sequentially anyway, there is no separate index image
+    bool load_index(std::function<void (const K &, plog_t, int)> appender, version_t &version) {
+	return false;
+    }
+    void save_index(version_t version, std::function<void (std::function<void (const K &, plog_t, int)>)> walk) { }
+
+    // records the clock after tag(), so that a restart resumes from it even without newer updates
+    void tag(version_t version) {
+	write(TAG, version);
+    }
+
+    plog_t allocate() {
+	return new log_t(this, next_id++);
+    }
+    void deallocate(plog_t ptr, bool cleanup = false) {
+	if (!cleanup)
+	    write(DROP, ptr->get_id());
+	delete ptr;
+    }
+    void reclaim(const std::vector<plog_t> &logs) {
+	batch([&] {
+	    for (auto log : logs)
+		write(DROP, log->get_id());
+	});
+	for (auto log : logs)
+	    delete log;
+    }
+    // the records written by fn on this thread are buffered and committed as one GROUP record,
+    // so that a restart replays either all of them or none. The entries fn inserts are applied
+    // in memory after the commit, and dropped if fn or the commit throws.
+    void batch(std::function<void ()> fn) {
+	if (batching == this) {
+	    fn();
+	    return;
+	}
+	batching = this;
+	group.clear();
+	deferred.clear();
+	serialize(group, (char)GROUP);
+	try {
+	    fn();
+	    batching = nullptr;
+	    if (group.size() > 1)
+		commit(group);
+	} catch (...) {
+	    batching = nullptr;
+	    deferred.clear();
+	    throw;
+	}
+	for (auto &apply : deferred)
+	    apply();
+	deferred.clear();
+    }
+    void append(const K &key, plog_t kh) {
+	write(KEY, kh->get_id(), key);
+    }
+};
+
+#endif // __HISTORY_LOG
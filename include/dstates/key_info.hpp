@@ -1,27 +1,37 @@
 #ifndef __KEY_INFO
 #define __KEY_INFO
 
+#include "version.hpp"
+
 #include <atomic>
 
 class key_info_t {
-    struct info_t {
-	int version{0};
-	bool removed{false};
-    };
-    std::atomic<info_t> info;
+    // latest version and removed flag packed into one word, so that update() stays a lock-free CAS
+    // for 64-bit versions too. Starts at version -1, so that an update at version 0 is recorded.
+    std::atomic<int64_t> info{pack(-1, false)};
+    static_assert(std::atomic<int64_t>::is_always_lock_free);
+
+    static int64_t pack(version_t t, bool removed) {
+	return (int64_t)t * 2 + removed;
+    }
+    static version_t version_of(int64_t packed) {
+	return packed >> 1;
+    }
 
 public:
-    void update(int t, bool removed) {
-	info_t prev, curr{t, removed};
-	do {
-	    prev = info.load();
-	} while (prev.version < t && !info.compare_exchange_weak(prev, curr));
+    void update(version_t t, bool removed) {
+	int64_t prev = info.load(), curr = pack(t, removed);
+	while (version_of(prev) < t && !info.compare_exchange_weak(prev, curr));
+    }
+    // overwrites the info, for a history whose newer entries were rolled back
+    void reset(version_t t, bool removed) {
+	info.store(pack(t, removed));
     }
-    int latest_version() const {
-	return info.load().version;
+    version_t latest_version() const {
+	return version_of(info.load());
     }
     int latest_removed() const {
-	return info.load().removed;
+	return info.load() & 1;
     }
 };
 
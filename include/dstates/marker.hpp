@@ -3,6 +3,7 @@
 
 #include <limits>
 #include <string>
+#include <string_view>
 #include <libpmemobj++/container/string.hpp>
 
 template <class T> struct marker_t {
@@ -22,4 +23,12 @@ template <class T> T get_volatile(const T &v) {
     return v;
 }
 
+// non-owning view of a (possibly persistent) value, valid only as long as the value itself
+inline std::string_view get_view(const pmem::obj::string &v) {
+    return std::string_view(v.data(), v.size());
+}
+template <class T> const T &get_view(const T &v) {
+    return v;
+}
+
 #endif // __MARKER
@@ -0,0 +1,656 @@
+#ifndef __MMAP_HISTORY
+#define __MMAP_HISTORY
+
+#include "marker.hpp"
+#include "key_info.hpp"
+#include "serializer.hpp"
+#include "sync_dir.hpp"
+#include "stats.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <filesystem>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "debug.hpp"
+
+// History provider persisted in a regular file through mmap, for machines without persistent memory.
+// Every key owns an append-only log in the file: a chain of extents of doubling capacity, each a dense
+// array of (version, value) slots that find() binary searches in place, nothing is mirrored in DRAM.
+// Values that do not fit the 8-byte slot word, strings among them, are written once to a blob the slot
+// points to. A directory of fixed-size entries binds every key to the first extent of its log.
+// Space is carved from the file by a bump allocator and given back when the next open compacts the file.
+// Writes are ordered by flushes: a slot counts once its stamp is durable, and the stamp is flushed after
+// everything the slot refers to. On a DAX file system the file is mapped with MAP_SYNC and flushed with
+// cache line flushes, otherwise through msync and the page cache.
+template <typename K, typename V> class mmap_history_t {
+    template <typename T> using view_t = typename std::conditional<std::is_same<T, std::string>::value, std::string_view, T>::type;
+    // trivially copyable types up to 8 bytes are stored in the word that refers to them
+    template <typename T> static constexpr bool INLINE = std::is_trivially_copyable<T>::value && sizeof(T) <= sizeof(uint64_t);
+
+    static constexpr size_t DEFAULT_FILE_SIZE = 64 << 20, MAX_FILE_SIZE = 1UL << 38, CHUNK = 1 << 16, LINE = 64,
+	FIRST_SLOTS = 4, EXTENTS = 24, DIR_SLOTS = 127, COMPACT_MIN = 1 << 18;
+    inline static const char MAGIC[8] = {'v', 'o', 'r', 'd', 'm', 'a', 'p', '2'};
+
+    struct header_t {
+	char magic[8];
+	uint32_t version_size, padding;
+	uint64_t tail, directory; // end of the allocated space, first directory block
+	int64_t clock, batch;     // latest tag, version + 1 of the batch in flight or 0
+	char reserved[16];
+    };
+    // a slot is valid once its stamp (version + 1) is set, the value word is written before it
+    struct slot_t {
+	uint64_t stamp, value;
+    };
+    // capacity slots follow the extent header
+    struct extent_t {
+	uint64_t next, capacity;
+    };
+    // the key is dead once head is 0, first is the number of truncated slots
+    struct entry_t {
+	uint64_t key, head, first, padding;
+    };
+    struct dir_block_t {
+	uint64_t next, padding[3];
+	entry_t entries[DIR_SLOTS];
+    };
+
+public:
+    class log_t {
+	friend class mmap_history_t;
+	mmap_history_t *owner;
+	// file offsets of the extents, extent k holds FIRST_SLOTS << k slots
+	std::atomic<uint64_t> extents[EXTENTS] = {};
+	std::atomic<size_t> count{0}, first{0};
+	uint64_t entry = 0; // file offset of the directory entry, 0 until append()
+	std::mutex write_mutex;
+
+	static size_t extent_of(size_t i) {
+	    return 63 - __builtin_clzll(i / FIRST_SLOTS + 1);
+	}
+	slot_t *slot(size_t i) {
+	    size_t k = extent_of(i);
+	    slot_t *slots = (slot_t *)(owner->base + extents[k].load() + sizeof(extent_t));
+	    return slots + i - FIRST_SLOTS * ((1UL << k) - 1);
+	}
+	version_t ts(size_t i) {
+	    return slot(i)->stamp - 1;
+	}
+	auto value(size_t i) {
+	    return owner->template load<V>(slot(i)->value);
+	}
+	// first index in [begin, end) with a timestamp > t
+	size_t upper(version_t t, size_t begin, size_t end) {
+	    while (begin < end) {
+		size_t middle = (begin + end) / 2;
+		if (ts(middle) <= t)
+		    begin = middle + 1;
+		else
+		    end = middle;
+	    }
+	    return begin;
+	}
+
+    public:
+	key_info_t info;
+
+	log_t(mmap_history_t *owner) : owner(owner) { }
+	log_t(const log_t &) = delete;
+
+	void insert(version_t t, const V &v) {
+	    std::unique_lock<std::mutex> lock(write_mutex);
+	    owner->write(*this, t, v);
+	    info.update(t, v == marker_t<V>::low_marker);
+	}
+	void remove(version_t t) {
+	    insert(t, marker_t<V>::low_marker);
+	}
+
+	V find(version_t t) {
+	    size_t begin = first.load(), i = upper(t, begin, count.load());
+	    return i == begin ? marker_t<V>::low_marker : V(value(i - 1));
+	}
+
+	// calls f(value) in place if a value is visible at version t
+	template <typename F> void visit(version_t t, F &&f) {
+	    size_t begin = first.load(), i = upper(t, begin, count.load());
+	    if (i == begin)
+		return;
+	    auto val = value(i - 1);
+	    if (val != marker_t<V>::low_marker)
+		f(val);
+	}
+
+	// calls f(ts, value) in place for every slot, strings are viewed in the mapping
+	template <typename F> void for_each(F &&f) {
+	    for_each(std::numeric_limits<version_t>::min(), std::numeric_limits<version_t>::max(), f);
+	}
+
+	// same as for_each, restricted to the entries with from <= ts <= to: seeks to from by binary search
+	template <typename F> void for_each(version_t from, version_t to, F &&f) {
+	    size_t i = first.load(), end = count.load();
+	    if (from > std::numeric_limits<version_t>::min())
+		i = upper(from - 1, i, end);
+	    for (; i < end && ts(i) <= to; i++)
+		f(ts(i), value(i));
+	}
+
+	template <typename T> void copy_to(std::vector<std::pair<T, V>> &result) {
+	    for_each([&](version_t ts, const auto &val) {
+		result.emplace_back(ts, val);
+	    });
+	}
+
+	template <typename T> void copy_to(version_t from, version_t to, std::vector<std::pair<T, V>> &result) {
+	    for_each(from, to, [&](version_t ts, const auto &val) {
+		result.emplace_back(ts, val);
+	    });
+	}
+
+	// drops the entries older than the newest one at or below t. Only the start of the log moves,
+	// the slots stay readable until the next compaction.
+	size_t truncate_before(version_t t) {
+	    std::unique_lock<std::mutex> lock(write_mutex);
+	    size_t begin = first.load(), i = upper(t, begin, count.load());
+	    if (i == begin)
+		return 0;
+	    size_t keep = i - 1;
+	    if (keep > begin) {
+		first.store(keep);
+		owner->set_first(*this);
+	    }
+	    return keep - begin;
+	}
+
+	void purge() { }
+
+	size_t size() {
+	    return count.load() - first.load();
+	}
+    };
+    typedef log_t* plog_t;
+
+private:
+    int fd = -1;
+    char *base = nullptr;
+    header_t *header = nullptr;
+    size_t length = 0; // file size, the mapping spans MAX_FILE_SIZE so that it never moves
+    uint64_t next = 0, chunk_end = 0;
+    uint64_t dir_block = 0;
+    size_t dir_used = DIR_SLOTS;
+    bool dax = false, bulk = false;
+    std::mutex alloc_mutex, dir_mutex;
+    counters_t<1> tx_count;
+    std::vector<std::pair<K, plog_t>> recovered; // live histories found on open, sorted by key
+    version_t recovered_version = 0;
+    size_t live_bytes = 0;
+
+    inline static thread_local mmap_history_t *batching = nullptr;
+    inline static thread_local std::vector<std::pair<plog_t, size_t>> touched;
+
+    static size_t padded(size_t size) {
+	return (size + 15) & ~(size_t)15;
+    }
+    template <typename T> T *at(uint64_t offset) {
+	return (T *)(base + offset);
+    }
+
+    void map() {
+	void *addr = MAP_FAILED;
+#ifdef MAP_SYNC
+	addr = mmap(nullptr, MAX_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC | MAP_NORESERVE, fd, 0);
+	dax = addr != MAP_FAILED;
+#endif
+	if (addr == MAP_FAILED)
+	    addr = mmap(nullptr, MAX_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+	if (addr == MAP_FAILED)
+	    throw std::runtime_error("cannot map history file: " + std::string(strerror(errno)));
+	base = (char *)addr;
+	header = (header_t *)base;
+    }
+
+    void unmap() {
+	if (base != nullptr) {
+	    msync(base, length, MS_SYNC);
+	    munmap(base, MAX_FILE_SIZE);
+	    base = nullptr;
+	}
+	if (fd >= 0)
+	    close(fd);
+	fd = -1;
+    }
+
+    // opens or creates db, with file_size bytes (0 for DEFAULT_FILE_SIZE) if created
+    // A failure after open() releases the fd and the mapping here: the destructor does not run for an
+    // object whose constructor throws.
+    void open_file(const std::string &db, size_t file_size) {
+	fd = open(db.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	    throw std::runtime_error("cannot open history file " + db + ": " + strerror(errno));
+	try {
+	    struct stat st;
+	    if (fstat(fd, &st) != 0)
+		throw std::runtime_error("cannot open history file " + db + ": " + strerror(errno));
+	    bool fresh = st.st_size == 0;
+	    length = fresh ? std::max(padded(file_size == 0 ? DEFAULT_FILE_SIZE : file_size), CHUNK) : st.st_size;
+	    if (fresh && ftruncate(fd, length) != 0)
+		throw std::runtime_error("cannot size history file " + db + ": " + strerror(errno));
+	    map();
+	    if (fresh) {
+		std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+		header->version_size = sizeof(version_t);
+		header->tail = sizeof(header_t);
+		persist(header, sizeof(header_t));
+		DBG("created a new history file, path = " << db);
+	    } else {
+		if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0)
+		    FATAL("file " << db << " is not a history file");
+		if (header->version_size != sizeof(version_t))
+		    FATAL("file " << db << " uses " << 8 * header->version_size << "-bit versions, built for " << 8 * sizeof(version_t));
+		DBG("opened an existing history file, path = " << db << ", dax = " << dax);
+	    }
+	} catch (...) {
+	    unmap();
+	    throw;
+	}
+    }
+
+    void flush(size_t begin, size_t end) {
+	if (bulk)
+	    return;
+	tx_count.add(0);
+#ifdef __SSE2__
+	if (dax) {
+	    for (size_t p = begin & ~(LINE - 1); p < end; p += LINE)
+		_mm_clflush(base + p);
+	    _mm_sfence();
+	    return;
+	}
+#endif
+	size_t page = sysconf(_SC_PAGESIZE), start = begin / page * page;
+	if (msync(base + start, end - start, MS_SYNC) != 0)
+	    throw std::runtime_error("cannot sync history file: " + std::string(strerror(errno)));
+    }
+    void persist(const void *p, size_t size) {
+	size_t begin = (const char *)p - base;
+	flush(begin, begin + size);
+    }
+
+    // carves size bytes out of the file. The tail in the header moves a chunk at a time and nothing
+    // is written past it, so the space handed out is zeroed and a crash can only leak part of a chunk.
+    uint64_t carve(size_t size) {
+	size = padded(size);
+	std::unique_lock<std::mutex> lock(alloc_mutex);
+	if (next + size > chunk_end) {
+	    uint64_t end = header->tail + std::max(size, CHUNK);
+	    if (end > length) {
+		size_t grown = length;
+		while (grown < end)
+		    grown *= 2;
+		if (grown > MAX_FILE_SIZE)
+		    throw std::runtime_error("history file full, maximum size reached");
+		if (ftruncate(fd, grown) != 0)
+		    throw std::runtime_error("cannot grow history file: " + std::string(strerror(errno)));
+		length = grown;
+	    }
+	    next = header->tail;
+	    header->tail = chunk_end = end;
+	    persist(&header->tail, sizeof(uint64_t));
+	}
+	uint64_t offset = next;
+	next += size;
+	return offset;
+    }
+
+    // the word that refers to v, blobs are durable when it is returned. The low marker of a blob type is word 0.
+    template <typename T> uint64_t store(const T &v) {
+	uint64_t word = 0;
+	if constexpr (INLINE<T>)
+	    std::memcpy(&word, &v, sizeof(T));
+	else if (!(v == marker_t<T>::low_marker)) {
+	    std::vector<char> buf;
+	    serialize(buf, v);
+	    word = carve(buf.size());
+	    std::memcpy(base + word, buf.data(), buf.size());
+	    persist(base + word, buf.size());
+	}
+	return word;
+    }
+    template <typename T> view_t<T> load(uint64_t word) {
+	view_t<T> v;
+	if constexpr (INLINE<T>)
+	    std::memcpy(&v, &word, sizeof(T));
+	else if (word == 0)
+	    v = marker_t<T>::low_marker;
+	else
+	    deserialize(base + word, v);
+	return v;
+    }
+    template <typename T> size_t blob_size(uint64_t word) {
+	if constexpr (INLINE<T>)
+	    return 0;
+	else if (word == 0)
+	    return 0;
+	else if constexpr (std::is_same<T, std::string>::value)
+	    return padded(sizeof(uint32_t) + load<T>(word).size());
+	else
+	    return padded(sizeof(T));
+    }
+
+    // links extent k of the log, durable before the slots written into it. Caller holds the write mutex.
+    void extend(log_t &log, size_t k) {
+	if (k >= EXTENTS)
+	    throw std::runtime_error("history full, maximum number of extents reached");
+	size_t capacity = FIRST_SLOTS << k;
+	uint64_t offset = carve(sizeof(extent_t) + capacity * sizeof(slot_t));
+	extent_t *extent = at<extent_t>(offset);
+	extent->capacity = capacity;
+	persist(extent, sizeof(extent_t));
+	uint64_t *link = k > 0 ? &at<extent_t>(log.extents[k - 1].load())->next : log.entry != 0 ? &at<entry_t>(log.entry)->head : nullptr;
+	if (link != nullptr) {
+	    *link = offset;
+	    persist(link, sizeof(uint64_t));
+	}
+	log.extents[k].store(offset);
+    }
+
+    // appends (t, v) to the log, caller holds the write mutex
+    void write(log_t &log, version_t t, const V &v) {
+	if (batching == this) {
+	    if (header->batch == 0) {
+		header->batch = t + 1;
+		persist(&header->batch, sizeof(int64_t));
+	    }
+	    touched.emplace_back(&log, log.count.load());
+	}
+	size_t i = log.count.load(), k = log_t::extent_of(i);
+	if (log.extents[k].load() == 0)
+	    extend(log, k);
+	slot_t *slot = log.slot(i);
+	slot->value = store(v);
+	slot->stamp = t + 1;
+	persist(slot, sizeof(slot_t));
+	log.count.store(i + 1);
+    }
+
+    // invalidates the slots of the log from count on, newest first
+    void rollback(log_t &log, size_t count) {
+	std::unique_lock<std::mutex> lock(log.write_mutex);
+	for (size_t i = log.count.load(); i > count; i--) {
+	    slot_t *slot = log.slot(i - 1);
+	    slot->stamp = 0;
+	    persist(slot, sizeof(slot_t));
+	}
+	log.count.store(std::min(count, log.count.load()));
+    }
+
+    void end_batch() {
+	if (header->batch != 0) {
+	    header->batch = 0;
+	    persist(&header->batch, sizeof(int64_t));
+	}
+    }
+
+    void set_first(log_t &log) {
+	if (log.entry == 0)
+	    return;
+	entry_t *entry = at<entry_t>(log.entry);
+	entry->first = log.first.load();
+	persist(&entry->first, sizeof(uint64_t));
+    }
+
+    void kill(plog_t log) {
+	if (log->entry == 0)
+	    return;
+	entry_t *entry = at<entry_t>(log->entry);
+	entry->head = 0;
+	persist(&entry->head, sizeof(uint64_t));
+    }
+
+    uint64_t reserve_entry() {
+	std::unique_lock<std::mutex> lock(dir_mutex);
+	if (dir_used == DIR_SLOTS) {
+	    uint64_t offset = carve(sizeof(dir_block_t));
+	    uint64_t *link = dir_block == 0 ? &header->directory : &at<dir_block_t>(dir_block)->next;
+	    *link = offset;
+	    persist(link, sizeof(uint64_t));
+	    dir_block = offset;
+	    dir_used = 0;
+	}
+	return (char *)&at<dir_block_t>(dir_block)->entries[dir_used++] - base;
+    }
+
+    // rebuilds the handle of a live directory entry: its extents and valid slots. The slots of a batch
+    // cut short by a crash are invalidated.
+    void load_log(log_t &log, entry_t &entry) {
+	uint64_t offset = entry.head;
+	size_t count = 0;
+	for (size_t k = 0; k < EXTENTS && offset != 0; k++) {
+	    log.extents[k].store(offset);
+	    extent_t *extent = at<extent_t>(offset);
+	    slot_t *slots = (slot_t *)(extent + 1);
+	    size_t valid = 0;
+	    while (valid < extent->capacity && slots[valid].stamp != 0)
+		valid++;
+	    count += valid;
+	    if (valid < extent->capacity)
+		break;
+	    offset = extent->next;
+	}
+	log.count.store(count);
+	while (header->batch != 0 && count > 0 && log.slot(count - 1)->stamp == (uint64_t)header->batch) {
+	    slot_t *slot = log.slot(--count);
+	    slot->stamp = 0;
+	    persist(slot, sizeof(slot_t));
+	}
+	log.count.store(count);
+	log.first.store(std::min<size_t>(entry.first, count));
+	log.entry = (char *)&entry - base;
+	if (count > log.first.load())
+	    log.info.update(log.ts(count - 1), log.value(count - 1) == marker_t<V>::low_marker);
+    }
+
+    // walks the directory and rebuilds the histories of the live keys, those left without entries are dropped
+    void scan() {
+	TIMER_START(scan);
+	next = chunk_end = header->tail;
+	recovered_version = header->clock;
+	live_bytes = sizeof(header_t);
+	size_t keys = 0;
+	for (uint64_t b = header->directory; b != 0; b = at<dir_block_t>(b)->next) {
+	    dir_block_t *block = at<dir_block_t>(b);
+	    dir_block = b;
+	    dir_used = 0;
+	    for (size_t e = 0; e < DIR_SLOTS; e++) {
+		entry_t &entry = block->entries[e];
+		if (entry.head == 0)
+		    continue;
+		plog_t log = new log_t(this);
+		load_log(*log, entry);
+		if (log->size() == 0) {
+		    kill(log);
+		    delete log;
+		    continue;
+		}
+		dir_used = e + 1;
+		recovered.emplace_back(K(load<K>(entry.key)), log);
+		recovered_version = std::max(recovered_version, log->info.latest_version());
+		live_bytes += sizeof(entry_t) + blob_size<K>(entry.key);
+		for (size_t k = 0, slots = 0; slots < log->size(); slots += FIRST_SLOTS << k, k++)
+		    live_bytes += sizeof(extent_t) + (FIRST_SLOTS << k) * sizeof(slot_t);
+		for (size_t i = log->first.load(); i < log->count.load(); i++)
+		    live_bytes += blob_size<V>(log->slot(i)->value);
+		keys++;
+	    }
+	}
+	end_batch();
+	std::sort(recovered.begin(), recovered.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+	TIMER_STOP(scan, "scanned history file, keys = " << keys << ", bytes = " << header->tail << ", live bytes = " << live_bytes);
+    }
+
+    // the file is mostly made of dead keys, truncated entries and extents that are not full
+    bool worth_compacting() {
+	return header->tail > std::max<size_t>(2 * live_bytes, COMPACT_MIN);
+    }
+
+    // rewrites the recovered histories into a fresh file, flushed once at the end and renamed over db,
+    // so that a crash leaves either file complete. The fresh file is then opened and scanned as usual.
+    void compact(const std::string &db) {
+	TIMER_START(compact);
+	std::string path = db + ".compact";
+	std::filesystem::remove(path);
+	{
+	    mmap_history_t out(path, 2 * live_bytes);
+	    out.bulk = true;
+	    for (auto &e : recovered) {
+		plog_t log = out.allocate();
+		out.append(e.first, log);
+		e.second->for_each([&](version_t t, const auto &val) {
+		    log->insert(t, V(val));
+		});
+		out.deallocate(log, true);
+	    }
+	    out.header->clock = recovered_version;
+	    if (msync(out.base, out.length, MS_SYNC) != 0 || fsync(out.fd) != 0)
+		throw std::runtime_error("cannot write " + path + ": " + strerror(errno));
+	}
+	if (std::rename(path.c_str(), db.c_str()) != 0)
+	    throw std::runtime_error("cannot replace history file " + db + ": " + strerror(errno));
+	sync_parent_dir(db);
+	for (auto &e : recovered)
+	    delete e.second;
+	recovered.clear();
+	unmap();
+	open_file(db, 0);
+	dir_block = 0;
+	dir_used = DIR_SLOTS;
+	scan();
+	TIMER_STOP(compact, "compacted history file, bytes = " << header->tail);
+    }
+
+public:
+    // db is a regular file, created with file_size bytes (0 for DEFAULT_FILE_SIZE) and doubled when full
+    mmap_history_t(const std::string &db, size_t file_size = 0) {
+	open_file(db, file_size);
+	try {
+	    scan();
+	    if (worth_compacting())
+		compact(db);
+	} catch (...) {
+	    for (auto &e : recovered)
+		delete e.second;
+	    unmap();
+	    throw;
+	}
+    }
+    mmap_history_t(const mmap_history_t &) = delete;
+    ~mmap_history_t() {
+	unmap();
+    }
+
+    version_t restore(std::function<void (const K &, plog_t)> appender) {
+	for (auto &e : recovered)
+	    appender(e.first, e.second);
+	return recovered_version;
+    }
+    // slow path while the index is restored in the background, answered from the recovered histories
+    plog_t lookup(const K &key) {
+	auto it = std::lower_bound(recovered.begin(), recovered.end(), key, [](const auto &e, const K &k) {
+	    return e.first < k;
+	});
+	return it != recovered.end() && it->first == key ? it->second : nullptr;
+    }
+    // the index owns the histories now and no lookup runs anymore
+    void release_lookup() {
+	recovered.clear();
+	recovered.shrink_to_fit();
+    }
+    // the directory is walked on open anyway, there is no separate index image
+    bool load_index(std::function<void (const K &, plog_t, int)> appender, version_t &version) {
+	return false;
+    }
+    void save_index(version_t version, std::function<void (std::function<void (const K &, plog_t, int)>)> walk) { }
+
+    // records the clock after tag(), so that a restart resumes from it even without newer updates
+    void tag(version_t version) {
+	if (header->clock < version) {
+	    header->clock = version;
+	    persist(&header->clock, sizeof(int64_t));
+	}
+    }
+
+    // number of flushes (msync or cache line flush rounds)
+    long transactions() {
+	return tx_count.get(0);
+    }
+    void clear_transactions() {
+	tx_count.clear();
+    }
+
+    plog_t allocate() {
+	return new log_t(this);
+    }
+    void deallocate(plog_t ptr, bool cleanup = false) {
+	if (!cleanup)
+	    kill(ptr);
+	delete ptr;
+    }
+    void reclaim(const std::vector<plog_t> &logs) {
+	for (auto log : logs) {
+	    kill(log);
+	    delete log;
+	}
+    }
+    // the slots fn writes must all carry one version: the header marks it in flight until fn returns, so that
+    // a restart invalidates the slots of a batch cut short by a crash. If fn throws, they are invalidated
+    // right away.
+    void batch(std::function<void ()> fn) {
+	if (batching == this) {
+	    fn();
+	    return;
+	}
+	batching = this;
+	touched.clear();
+	try {
+	    fn();
+	} catch (...) {
+	    batching = nullptr;
+	    for (auto it = touched.rbegin(); it != touched.rend(); it++)
+		rollback(*it->first, it->second);
+	    end_batch();
+	    throw;
+	}
+	batching = nullptr;
+	end_batch();
+    }
+    // binds key to the log, the log may not have any extent yet
+    void append(const K &key, plog_t log) {
+	uint64_t word = store(key);
+	std::unique_lock<std::mutex> lock(log->write_mutex);
+	entry_t *entry = at<entry_t>(reserve_entry());
+	entry->key = word;
+	entry->first = log->first.load();
+	entry->head = log->extents[0].load();
+	persist(entry, sizeof(entry_t));
+	log->entry = (char *)entry - base;
+    }
+};
+
+#endif // __MMAP_HISTORY
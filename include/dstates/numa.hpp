@@ -0,0 +1,71 @@
+#ifndef __NUMA
+#define __NUMA
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <algorithm>
+#include <filesystem>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// NUMA topology as exposed by sysfs, so that callers can match threads and pools without libnuma.
+// On a machine (or container) without /sys/devices/system/node, everything is node 0.
+namespace numa {
+    static const std::string NODE_DIR = "/sys/devices/system/node";
+
+    // the node of the cpu the calling thread runs on right now
+    inline int current_node() {
+	unsigned cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+	    return 0;
+	return node;
+    }
+
+    inline std::vector<int> nodes() {
+	std::vector<int> result;
+	std::error_code ec;
+	for (auto &entry : std::filesystem::directory_iterator(NODE_DIR, ec)) {
+	    std::string name = entry.path().filename().string();
+	    if (name.compare(0, 4, "node") == 0 && name.size() > 4 && isdigit(name[4]))
+		result.push_back(std::stoi(name.substr(4)));
+	}
+	if (result.empty())
+	    result.push_back(0);
+	std::sort(result.begin(), result.end());
+	return result;
+    }
+
+    // parses a cpulist such as "0-3,8-11"
+    inline std::vector<int> cpus_of(int node) {
+	std::vector<int> result;
+	std::ifstream list(NODE_DIR + "/node" + std::to_string(node) + "/cpulist");
+	std::string range;
+	while (std::getline(list, range, ',')) {
+	    int lo, hi;
+	    char dash;
+	    std::istringstream fields(range);
+	    if (!(fields >> lo))
+		continue;
+	    hi = (fields >> dash >> hi) ? hi : lo;
+	    for (int cpu = lo; cpu <= hi; cpu++)
+		result.push_back(cpu);
+	}
+	return result;
+    }
+
+    // pins the calling thread to the cpus of node, false if the node has none we may run on
+    inline bool bind_to_node(int node) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (auto cpu : cpus_of(node))
+	    if (cpu < CPU_SETSIZE)
+		CPU_SET(cpu, &set);
+	return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+}
+
+#endif // __NUMA
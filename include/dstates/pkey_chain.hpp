@@ -4,9 +4,13 @@
 #include <libpmemobj++/pool.hpp>
 #include <libpmemobj++/mutex.hpp>
 #include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/make_persistent_array.hpp>
 #include <libpmemobj++/transaction.hpp>
 #include <libpmemobj++/container/array.hpp>
 
+#include <vector>
+#include <stdexcept>
+
 template <class T, size_t N> class pkey_chain_t {
     struct link_t {
         typedef pmem::obj::persistent_ptr<link_t> ptr_t;
@@ -14,14 +18,53 @@ template <class T, size_t N> class pkey_chain_t {
         ptr_t next = nullptr;
     };
     typedef typename link_t::ptr_t plink_t;
+    static const size_t SEGMENTS = 40;
+
+    // Block directory, so that restore can split the chain into ranges without walking it:
+    // segment k holds 2^k block pointers and covers the blocks [2^k - 1, 2^(k + 1) - 1).
+    struct directory_t {
+        pmem::obj::array<pmem::obj::persistent_ptr<plink_t[]>, SEGMENTS> segments;
+    };
 
+    // the fields before directory keep the layout of legacy_t
     plink_t head, tail;
     pmem::obj::p<size_t> no_blocks;
     pmem::obj::mutex tx_mutex;
     pmem::obj::pool_base pool;
     size_t pending = 0;
+    pmem::obj::persistent_ptr<directory_t> directory;
+
+    void find_pending() {
+        // erased slots may leave holes, so look for the last occupied one
+        pending = N;
+        while (pending > 0 && tail->block[pending - 1] == T())
+            pending--;
+    }
+
+    static size_t segment_of(size_t b) {
+        return 63 - __builtin_clzll(b + 1);
+    }
+
+    // runs inside the transaction that links block b
+    void publish(size_t b, plink_t link) {
+        size_t k = segment_of(b);
+        if (k >= SEGMENTS)
+            throw std::runtime_error("key chain full, maximum number of directory segments reached");
+        if (directory->segments[k] == nullptr)
+            directory->segments[k] = pmem::obj::make_persistent<plink_t[]>(1UL << k);
+        directory->segments[k][b + 1 - (1UL << k)] = link;
+    }
 
 public:
+    // a chain written before the block directory existed
+    struct legacy_t {
+        plink_t head, tail;
+        pmem::obj::p<size_t> no_blocks;
+        pmem::obj::mutex tx_mutex;
+        pmem::obj::pool_base pool;
+        size_t pending;
+    };
+
     pkey_chain_t() {
         pool = pmem::obj::pool_by_vptr(this);
 	std::scoped_lock<pmem::obj::mutex> lock(tx_mutex);
@@ -29,11 +72,26 @@ public:
             pmem::obj::transaction::run(pool, [&] {
                 head = pmem::obj::make_persistent<link_t>();
                 tail = head;
+                directory = pmem::obj::make_persistent<directory_t>();
+                publish(0, head);
                 no_blocks = 1;
             });
         else
-            while (pending < N && tail->block[pending] == T())
-		pending++;
+            find_pending();
+    }
+
+    // takes over the blocks of a legacy chain and builds their directory,
+    // runs inside the transaction that replaces the legacy chain
+    pkey_chain_t(legacy_t &legacy) {
+        pool = pmem::obj::pool_by_vptr(this);
+        head = legacy.head;
+        tail = legacy.tail;
+        directory = pmem::obj::make_persistent<directory_t>();
+        size_t b = 0;
+        for (plink_t link = head; link != nullptr; link = link->next)
+            publish(b++, link);
+        no_blocks = b;
+        find_pending();
     }
 
     template<class... Args > void append(Args&&... args) {
@@ -45,6 +103,7 @@ public:
 		plink_t extra = pmem::obj::make_persistent<link_t>();
 		tail->next = extra;
 		tail = extra;
+		publish(no_blocks, extra);
 		no_blocks++;
 	    });
 	    pending = 0;
@@ -59,6 +118,43 @@ public:
         });
     }
 
+    // frees the slots taken by appends whose transaction was aborted
+    void recover_pending() {
+	std::scoped_lock<pmem::obj::mutex> lock(tx_mutex);
+	find_pending();
+    }
+
+    // resets every slot matching pred, in one transaction per block that has any. Only the slots appended
+    // so far are visited, blocks linked meanwhile are left alone. Returns the number of transactions run.
+    template<class Pred> size_t erase_if(Pred pred) {
+        plink_t last;
+        size_t end;
+        {
+            std::scoped_lock<pmem::obj::mutex> lock(tx_mutex);
+            last = tail;
+            end = pending;
+        }
+        size_t transactions = 0;
+        for (plink_t link = head; link != nullptr; link = link == last ? nullptr : link->next) {
+            size_t slots = link == last ? end : N;
+            std::vector<size_t> erased;
+            for (size_t slot = 0; slot < slots; slot++)
+                if (!(link->block[slot] == T()) && pred(link->block[slot]))
+                    erased.push_back(slot);
+            if (erased.empty())
+                continue;
+            pmem::obj::transaction::run(pool, [&] {
+                for (auto slot : erased) {
+                    T* pslot = &link->block[slot];
+                    pslot->~T();
+                    new (pslot) T();
+                }
+            });
+            transactions++;
+        }
+        return transactions;
+    }
+
     size_t size() {
 	std::scoped_lock<pmem::obj::mutex> lock(tx_mutex);
         return N * (no_blocks - 1) + pending;
@@ -67,6 +163,16 @@ public:
     plink_t get_head() {
         return head;
     }
+
+    size_t blocks() {
+        return no_blocks;
+    }
+
+    // block b of the chain in append order, b < blocks()
+    plink_t get_block(size_t b) {
+        size_t k = segment_of(b);
+        return directory->segments[k][b + 1 - (1UL << k)];
+    }
 };
 
 #endif //__PKEY_CHAIN
@@ -2,6 +2,7 @@
 #define __PKEY_HISTORY_T
 
 #include "marker.hpp"
+#include "key_info.hpp"
 
 #include <type_traits>
 #include <shared_mutex>
@@ -11,13 +12,34 @@
 #include <libpmemobj++/container/vector.hpp>
 #include <libpmemobj++/container/string.hpp>
 
-template <class V> class pkey_history_t {
+// VT is the version type stored in the log, only pools created with 32-bit versions use another one than version_t
+template <class V, class VT = version_t> class pkey_history_t {
     typedef typename std::conditional<std::is_same<V, std::string>::value, pmem::obj::string, V>::type PV;
-    typedef std::pair<int, PV> entry_t;
+    typedef std::pair<VT, PV> entry_t;
     pmem::obj::vector<entry_t> log;
     pmem::obj::shared_mutex tx_mutex;
 
+    // index of the newest entry with timestamp <= t, -1 if none; caller holds tx_mutex
+    int locate(version_t t) {
+        int left = 0, right = log.size() - 1;
+        while (left <= right) {
+            int middle = (left + right) / 2;
+            if (t < log[middle].first)
+                right = middle - 1;
+            else if (t > log[middle].first)
+                left = middle + 1;
+            else
+                return middle;
+        }
+        return right;
+    }
+
 public:
+    // tag of this layout in the pool root, see pmem_history_t
+    static constexpr uint8_t LAYOUT = 1;
+    // the log of a pool written before 64-bit versions, see pmem_history_t::migrate()
+    typedef pkey_history_t<V, int32_t> legacy_t;
+
     key_info_t info;
 
     pkey_history_t() {
@@ -25,7 +47,17 @@ public:
 	    info.update(log.back().first, log.back().second == marker_t<V>::low_marker);
     }
 
-    void insert(int t, const V &v) {
+    // rebuilds info from the newest entry, for a log whose info word was written with another layout.
+    // Runs inside the caller's transaction, which snapshots the word first.
+    void rebuild_info() {
+	pmemobj_tx_add_range_direct(&info, sizeof(info));
+	if (log.size() > 0)
+	    info.reset(log.back().first, log.back().second == marker_t<V>::low_marker);
+	else
+	    info.reset(-1, false);
+    }
+
+    void insert(version_t t, const V &v) {
         auto pool = pmem::obj::pool_by_vptr(this);
         pmem::obj::transaction::run(pool, [&] {
             if (log.size() > 0 && log.back().first == t) {
@@ -37,32 +69,75 @@ public:
 	info.update(t, v == marker_t<V>::low_marker);
     }
 
-    void remove(int t) {
+    void remove(version_t t) {
         insert(t, marker_t<V>::low_marker);
     }
 
-    V find(int t) {
+    V find(version_t t) {
 	std::shared_lock<pmem::obj::shared_mutex> read_lock(tx_mutex);
-        int left = 0, right = log.size() - 1;
-        while (left <= right) {
-            int middle = (left + right) / 2;
-            if (t < log[middle].first)
-                right = middle - 1;
-            else if (t > log[middle].first)
-                left = middle + 1;
-            else
-                return get_volatile(log[middle].second);
-        }
-        return (right < 0) ? marker_t<V>::low_marker : get_volatile(log[right].second);
+        int i = locate(t);
+        return (i < 0) ? marker_t<V>::low_marker : get_volatile(log[i].second);
+    }
+
+    // calls f(value) in place if a value is visible at version t
+    template <typename F> void visit(version_t t, F &&f) {
+	std::shared_lock<pmem::obj::shared_mutex> read_lock(tx_mutex);
+        int i = locate(t);
+        if (i >= 0 && log[i].second != marker_t<V>::low_marker)
+            f(get_view(log[i].second));
     }
 
-    void copy_to(std::vector<std::pair<int, V>> &result) {
+    // calls f(ts, value) in place for every log entry, without copying the log
+    template <typename F> void for_each(F &&f) {
 	std::shared_lock<pmem::obj::shared_mutex> read_lock(tx_mutex);
 	int log_size = log.size();
         for (int i = 0; i < log_size; i++)
-            result.emplace_back(log[i].first, get_volatile(log[i].second));
+            f(log[i].first, get_view(log[i].second));
+    }
+
+    // same as for_each, restricted to the entries with from <= ts <= to: seeks to from by binary search
+    template <typename F> void for_each(version_t from, version_t to, F &&f) {
+	std::shared_lock<pmem::obj::shared_mutex> read_lock(tx_mutex);
+	int i = locate(from), log_size = log.size();
+	if (i < 0 || log[i].first < from)
+	    i++;
+        for (; i < log_size && log[i].first <= to; i++)
+            f(log[i].first, get_view(log[i].second));
+    }
+
+    template <typename T> void copy_to(std::vector<std::pair<T, V>> &result) {
+        for_each([&](version_t ts, const auto &val) {
+            result.emplace_back(ts, val);
+        });
+    }
+
+    template <typename T> void copy_to(version_t from, version_t to, std::vector<std::pair<T, V>> &result) {
+        for_each(from, to, [&](version_t ts, const auto &val) {
+            result.emplace_back(ts, val);
+        });
+    }
+
+    // drops the entries older than the newest one at or below t, returns how many were dropped.
+    // Checked under the shared lock first, so that a sweep over keys with nothing to drop runs no transaction.
+    size_t truncate_before(version_t t) {
+        {
+            std::shared_lock<pmem::obj::shared_mutex> read_lock(tx_mutex);
+            if (locate(t) <= 0)
+                return 0;
+        }
+        int dropped = 0;
+        auto pool = pmem::obj::pool_by_vptr(this);
+        pmem::obj::transaction::run(pool, [&] {
+            dropped = std::max(locate(t), 0);
+            if (dropped > 0)
+                log.erase(log.begin(), log.begin() + dropped);
+        }, tx_mutex);
+        return dropped;
     }
 
+    // truncated entries are released immediately, readers are excluded by tx_mutex
+    void purge() { }
+
     size_t size() {
 	std::shared_lock<pmem::obj::shared_mutex> read_lock(tx_mutex);
         return log.size();
@@ -2,18 +2,31 @@
 #define __PMEM_HISTORY
 
 #include "pkey_history.hpp"
+#include "popt_history.hpp"
 #include "pkey_chain.hpp"
+#include "serializer.hpp"
+#include "stats.hpp"
 
 #include <omp.h>
+#include <libpmemobj++/make_persistent_array.hpp>
+#include <unordered_set>
+#include <unordered_map>
+#include <shared_mutex>
+#include <algorithm>
+#include <queue>
 #include <thread>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
 #include <unistd.h>
 
 #define __DEBUG
 #include "debug.hpp"
 
-template <typename K, typename V> class pmem_history_t {
+// H is the persistent key history, pkey_history_t or popt_history_t
+template <typename K, typename V, typename H = pkey_history_t<V>> class pmem_history_t {
 public:
-    typedef pkey_history_t<V> log_t;
+    typedef H log_t;
     typedef pmem::obj::persistent_ptr<log_t> plog_t;
 
 private:
@@ -24,63 +37,328 @@ private:
     typedef std::pair<PK, plog_t> entry_t;
     typedef pkey_chain_t<entry_t, BLOCK_SIZE> keymap_t;
     typedef pmem::obj::persistent_ptr<keymap_t> pkeymap_t;
+    // sorted (key, history, tower height) records of the skip list, written at clean shutdown
+    struct image_t {
+	pmem::obj::p<version_t> version;
+	pmem::obj::p<size_t> count, size;
+	pmem::obj::persistent_ptr<char[]> data;
+    };
+    typedef pmem::obj::persistent_ptr<image_t> pimage_t;
     struct root_t {
 	pkeymap_t keymap;
+	pimage_t image; // zero-extended when an older pool is opened
+	pmem::obj::p<uint8_t> version_size; // sizeof(version_t) of the histories, 0 for pools written before it, with 32-bit versions and no chain directory
+	// progress of migrate(), so that it resumes where a crash interrupted it
+	pmem::obj::p<uint8_t> chain_converted;
+	pmem::obj::p<size_t> migrated; // key chain slots whose histories are rewritten
+	pmem::obj::p<uint8_t> layout; // H::LAYOUT of the histories, 0 for pools written before it
     };
     typedef pmem::obj::pool<root_t> pool_t;
 
     pool_t pool;
+    counters_t<1> tx_count; // transactions run by the pool itself, history writes are counted by the caller
+
+    // side index of lookup(): the keys of the first side_blocks blocks of the key chain, dropped by
+    // release_lookup(). The chain does not change meanwhile, writers wait for the restore.
+    std::shared_mutex side_mutex;
+    std::unordered_map<K, plog_t> side_index;
+    size_t side_blocks = 0;
+
+    static bool is_poolset(const std::string &db) {
+	return db.size() > 4 && db.compare(db.size() - 4, 4, ".set") == 0;
+    }
+
+    // the set file is written before the pool: the pool exists once any of its parts does, either as a
+    // file or as a non-empty directory. Every "<size> <path>" line of every local replica is checked;
+    // remote replicas ("REPLICA <node> <set>") are not, which is fine since PMDK requires the master
+    // replica to be local, so a created pool always has local parts. Creating over partly removed parts
+    // is left to PMDK, which fails instead of overwriting them.
+    static bool poolset_created(const std::string &db) {
+	std::ifstream set(db);
+	std::string line;
+	while (std::getline(set, line)) {
+	    std::istringstream fields(line);
+	    std::string size, path;
+	    if (!(fields >> size >> path) || !isdigit(size[0]))
+		continue;
+	    std::error_code ec;
+	    if (std::filesystem::is_directory(path, ec) ? !std::filesystem::is_empty(path, ec) : std::filesystem::exists(path, ec))
+		return true;
+	}
+	return false;
+    }
+
+    void create(const std::string &db, size_t pool_size) {
+	// in root we have key-map
+	pool = pmem::obj::pool<root_t>::create(db, POOL_NAME, is_poolset(db) ? 0 : pool_size);
+	pmem::obj::transaction::run(pool, [&] {
+	    pool.root()->keymap = pmem::obj::make_persistent<keymap_t>();
+	    pool.root()->version_size = sizeof(version_t);
+	    pool.root()->layout = log_t::LAYOUT;
+	});
+	DBG("created a new pmembobj pool, path = " << db);
+    }
 
 public:
+    static const size_t DEFAULT_POOL_SIZE = 4294967296UL;
+
 // creates persistent memroy
-    pmem_history_t(const std::string &db) {
-	if (access(db.c_str(), F_OK) != 0) {
-		// in root we have key-map
-            pool = pmem::obj::pool<root_t>::create(db, POOL_NAME, 4294967296);
+    // db is either a pool file, created with pool_size bytes (0 for DEFAULT_POOL_SIZE), or a PMDK poolset
+    // file (*.set), whose parts give the size. A poolset with directory parts grows on demand instead
+    // of failing once the initial size is used up.
+    pmem_history_t(const std::string &db, size_t pool_size = 0) {
+	if (pool_size == 0)
+	    pool_size = DEFAULT_POOL_SIZE;
+	if (is_poolset(db) ? !poolset_created(db) : access(db.c_str(), F_OK) != 0) {
+	    create(db, pool_size);
+	    return;
+	}
+	pool = pmem::obj::pool<root_t>::open(db, POOL_NAME);
+	DBG("opened an existing pmemobj pool, path = " << db);
+	int version_size = pool.root()->version_size;
+	if (version_size == 0)
+	    migrate();
+	else if (version_size != (int)sizeof(version_t)) {
+	    pool.close();
+	    FATAL("pool " << db << " uses " << 8 * version_size << "-bit versions, built for " << 8 * sizeof(version_t));
+	} else if (pool.root()->layout == 0)
+	    // written after 64-bit versions but before the tag: the histories already have the current layout
 	    pmem::obj::transaction::run(pool, [&] {
-		pool.root()->keymap = pmem::obj::make_persistent<keymap_t>();
+		pool.root()->layout = log_t::LAYOUT;
 	    });
-            DBG("created a new pmembobj pool, path = " << db);
-        } else {
-            pool = pmem::obj::pool<root_t>::open(db, POOL_NAME);
-            DBG("opened an existing pmemobj pool, path = " << db);
+	int layout = pool.root()->layout;
+	if (layout != log_t::LAYOUT) {
+	    pool.close();
+	    FATAL("pool " << db << " uses history layout " << layout << ", built for " << (int)log_t::LAYOUT);
 	}
     }
     ~pmem_history_t() {
 	pool.close();
     }
-	// we build the skip list out 
-    int restore(std::function<bool (const K &, const V &, plog_t)> inserter) {
+
+    // gives the key chain of a pool written before the block directory existed its directory, in one
+    // transaction. The directory grows the chain object, so it is copied instead of extended in place.
+    void convert_chain() {
+	typedef typename keymap_t::legacy_t legacy_t;
+	pmem::obj::persistent_ptr<legacy_t> legacy(pool.root()->keymap.raw());
+	pmem::obj::transaction::run(pool, [&] {
+	    pool.root()->keymap = pmem::obj::make_persistent<keymap_t>(*legacy);
+	    pmem::obj::delete_persistent<legacy_t>(legacy);
+	    pool.root()->chain_converted = 1;
+	});
+	DBG("added a block directory to the key chain, blocks = " << pool.root()->keymap->blocks());
+    }
+
+    // upgrades a pool written before version_size existed: converts its key chain, then rewrites the
+    // histories from the legacy layout of H, one transaction per key. When that layout is log_t itself
+    // (pkey_history_t with 32-bit versions) the logs are kept, but their info word still has the old
+    // {int version; bool removed} layout, so it is rebuilt from the newest entry.
+    // Every step is recorded in the root within its own transaction, so that reopening after a crash resumes
+    // the migration instead of repeating a step. Once the histories are rewritten, the index image refers to
+    // the old ones, so it is dropped and the next open does a full restore. Such pools carry no layout tag
+    // either, so they are taken to hold H histories: opening them with the other history type is not detected.
+    void migrate() {
+	typedef typename log_t::legacy_t legacy_t;
+	constexpr bool in_place = std::is_same<legacy_t, log_t>::value;
+	TIMER_START(migrate);
+	auto root = pool.root();
+	if (!root->chain_converted)
+	    convert_chain();
+	size_t count = 0;
+	auto keymap = root->keymap;
+	for (size_t slot = root->migrated; slot < keymap->blocks() * BLOCK_SIZE; slot++) {
+	    auto link = keymap->get_block(slot / BLOCK_SIZE);
+	    size_t i = slot % BLOCK_SIZE;
+	    plog_t log = link->block[i].second;
+	    if (log == nullptr)
+		continue;
+	    pmem::obj::persistent_ptr<legacy_t> legacy(log.raw());
+	    pmem::obj::transaction::run(pool, [&] {
+		if constexpr (in_place)
+		    legacy->rebuild_info();
+		else {
+		    plog_t fresh = pmem::obj::make_persistent<log_t>();
+		    legacy->for_each([&](int32_t ts, const auto &val) {
+			fresh->insert(ts, V(val));
+		    });
+		    pmem::obj::delete_persistent<legacy_t>(legacy);
+		    link->block[i].second = fresh;
+		}
+		root->migrated = slot + 1;
+	    });
+	    count++;
+	}
+	pmem::obj::transaction::run(pool, [&] {
+	    pimage_t image = pool.root()->image;
+	    if (image != nullptr && !in_place) {
+		pmem::obj::delete_persistent<char[]>(image->data, image->size);
+		pmem::obj::delete_persistent<image_t>(image);
+		pool.root()->image = nullptr;
+	    }
+	    pool.root()->version_size = sizeof(version_t);
+	    pool.root()->layout = log_t::LAYOUT;
+	});
+	TIMER_STOP(migrate, "migrated histories from 32-bit versions, keys = " << count);
+    }
+    // collects the (key, history) pairs of the key chain in parallel, each thread reading a contiguous range
+    // of blocks found through the block directory and sorting its own pairs. One k-way merge then hands them
+    // to appender in ascending key order, so that the skip list is built in one pass. Returns the latest version.
+    version_t restore(std::function<void (const K &, plog_t)> appender) {
 	TIMER_START(restore_index);
-	std::atomic<int> count{0}, version{0};
-	int thread_no = std::thread::hardware_concurrency();
+	std::atomic<version_t> version{0};
+	auto keymap = pool.root()->keymap;
+	int thread_no = std::thread::hardware_concurrency(), blocks = keymap->blocks();
+	std::vector<std::vector<std::pair<K, plog_t>>> parts(thread_no);
         #pragma omp parallel num_threads(thread_no)
 	{
-	    auto head = pool.root()->keymap->get_head();
-	    int block_id = 0;
-	    while (head) {
-		if (block_id % thread_no == omp_get_thread_num()) {
-		    for (size_t i = 0; i < BLOCK_SIZE; i++) {
-			plog_t log = head->block[i].second;
-			if (log) {
-			    int prev, curr = log->info.latest_version();
-			    do {
-				prev = version.load();
-			    } while (prev < curr && !version.compare_exchange_weak(prev, curr));
-			    inserter(get_volatile(head->block[i].first), V(), log);
-			    count++;
-			}
+	    auto &local = parts[omp_get_thread_num()];
+	    #pragma omp for schedule(static) nowait
+	    for (int b = 0; b < blocks; b++) {
+		auto link = keymap->get_block(b);
+		for (size_t i = 0; i < BLOCK_SIZE; i++) {
+		    plog_t log = link->block[i].second;
+		    if (log) {
+			version_t prev, curr = log->info.latest_version();
+			do {
+			    prev = version.load();
+			} while (prev < curr && !version.compare_exchange_weak(prev, curr));
+			local.emplace_back(get_volatile(link->block[i].first), log);
 		    }
 		}
-		head = head->next;
-		block_id++;
 	    }
+	    std::sort(local.begin(), local.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+	}
+	// the heap holds the (part, position) of the smallest pair not handed out yet of every part
+	typedef std::pair<size_t, size_t> cursor_t;
+	auto later = [&](const cursor_t &a, const cursor_t &b) {
+	    return parts[b.first][b.second].first < parts[a.first][a.second].first;
+	};
+	std::priority_queue<cursor_t, std::vector<cursor_t>, decltype(later)> heap(later);
+	for (size_t p = 0; p < parts.size(); p++)
+	    if (!parts[p].empty())
+		heap.emplace(p, 0);
+	size_t count = 0;
+	while (!heap.empty()) {
+	    cursor_t c = heap.top();
+	    heap.pop();
+	    auto &e = parts[c.first][c.second];
+	    appender(e.first, e.second);
+	    count++;
+	    if (++c.second < parts[c.first].size())
+		heap.push(c);
 	}
 	TIMER_STOP(restore_index, "restored keys = " << count);
 	return version.load();
     }
 
+    // slow path while the index is restored in the background, returns the history of key or nullptr.
+    // Probes the side index first, then indexes the blocks not scanned yet until key turns up,
+    // so that every block is scanned at most once.
+    plog_t lookup(const K &key) {
+	{
+	    std::shared_lock<std::shared_mutex> lock(side_mutex);
+	    auto it = side_index.find(key);
+	    if (it != side_index.end())
+		return it->second;
+	}
+	std::unique_lock<std::shared_mutex> lock(side_mutex);
+	// another lookup may have scanned further while this one waited for the lock
+	auto it = side_index.find(key);
+	if (it != side_index.end())
+	    return it->second;
+	auto keymap = pool.root()->keymap;
+	plog_t result = nullptr;
+	for (; side_blocks < keymap->blocks() && result == nullptr; side_blocks++) {
+	    auto link = keymap->get_block(side_blocks);
+	    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+		plog_t log = link->block[i].second;
+		if (log == nullptr)
+		    continue;
+		if (get_view(link->block[i].first) == key)
+		    result = log;
+		side_index.emplace(get_volatile(link->block[i].first), log);
+	    }
+	}
+	return result;
+    }
+    // the index is restored and no lookup runs anymore
+    void release_lookup() {
+	std::unique_lock<std::shared_mutex> lock(side_mutex);
+	side_index = {};
+	side_blocks = 0;
+    }
+
+    // replays the index image saved by the last clean shutdown in key order, then drops it,
+    // so that a crash later on can never make a stale image look valid
+    bool load_index(std::function<void (const K &, plog_t, int)> appender, version_t &version) {
+	pimage_t image = pool.root()->image;
+	if (image == nullptr)
+	    return false;
+	TIMER_START(load_index);
+	const char *p = image->data.get();
+	size_t count = image->count;
+	for (size_t i = 0; i < count; i++) {
+	    K key;
+	    PMEMoid oid;
+	    uint8_t levels;
+	    p = deserialize(p, key);
+	    p = deserialize(p, oid);
+	    p = deserialize(p, levels);
+	    appender(key, plog_t(oid), levels);
+	}
+	version = image->version;
+	pmem::obj::transaction::run(pool, [&] {
+	    pmem::obj::delete_persistent<char[]>(image->data, image->size);
+	    pmem::obj::delete_persistent<image_t>(image);
+	    pool.root()->image = nullptr;
+	});
+	TIMER_STOP(load_index, "loaded index image, keys = " << count);
+	return true;
+    }
+
+    // walk(emit) must call emit(key, history, levels) for every key in ascending order
+    void save_index(version_t version, std::function<void (std::function<void (const K &, plog_t, int)>)> walk) {
+	TIMER_START(save_index);
+	std::vector<char> buf;
+	size_t count = 0;
+	walk([&](const K &key, plog_t log, int levels) {
+	    serialize(buf, key);
+	    serialize(buf, log.raw());
+	    serialize(buf, (uint8_t)levels);
+	    count++;
+	});
+	pmem::obj::transaction::run(pool, [&] {
+	    if (pool.root()->image != nullptr) {
+		pmem::obj::delete_persistent<char[]>(pool.root()->image->data, pool.root()->image->size);
+		pmem::obj::delete_persistent<image_t>(pool.root()->image);
+	    }
+	    pimage_t image = pmem::obj::make_persistent<image_t>();
+	    image->version = version;
+	    image->count = count;
+	    image->size = buf.size();
+	    image->data = pmem::obj::make_persistent<char[]>(buf.size());
+	    std::memcpy(image->data.get(), buf.data(), buf.size());
+	    pool.persist(image->data.get(), buf.size());
+	    pool.root()->image = image;
+	});
+	TIMER_STOP(save_index, "saved index image, keys = " << count);
+    }
+
+    // the restored version is the latest one written, tags are not persisted
+    void tag(version_t version) { }
+
+    long transactions() {
+	return tx_count.get(0);
+    }
+    void clear_transactions() {
+	tx_count.clear();
+    }
+
+    // every history comes from this one pool, whatever node the calling thread runs on: batch() commits
+    // all histories it touches in one transaction, and a PMDK transaction cannot span pools. NUMA
+    // placement is per store, see sharded_kv_t.
     plog_t allocate() {
+	tx_count.add(0);
 	plog_t ptr;
 	pmem::obj::transaction::run(pool, [&] {
 	    ptr = pmem::obj::make_persistent<log_t>();
@@ -90,11 +368,38 @@ public:
     void deallocate(plog_t ptr, bool cleanup = false) {
 	if (cleanup)
 	    return;
+	tx_count.add(0);
 	pmem::obj::transaction::run(pool, [&] {
 	    pmem::obj::delete_persistent<log_t>(ptr);
 	});
     }
+    // frees histories of reclaimed keys: their key chain slots are cleared first, so that a crash
+    // in between can only leak a history, never leave a dangling pointer for restore()
+    void reclaim(const std::vector<plog_t> &logs) {
+	std::unordered_set<log_t *> dead;
+	for (auto &log : logs)
+	    dead.insert(log.get());
+	tx_count.add(0, pool.root()->keymap->erase_if([&](const entry_t &e) {
+	    return dead.count(e.second.get()) > 0;
+	}) + 1);
+	pmem::obj::transaction::run(pool, [&] {
+	    for (auto &log : logs)
+		pmem::obj::delete_persistent<log_t>(log);
+	});
+    }
+    // runs fn in one transaction: the per-key transactions it starts are nested and flattened into it,
+    // so the whole batch is flushed once at commit. If it aborts, the key chain slots it took are handed back.
+    void batch(std::function<void ()> fn) {
+	tx_count.add(0);
+	try {
+	    pmem::obj::transaction::run(pool, fn);
+	} catch (...) {
+	    pool.root()->keymap->recover_pending();
+	    throw;
+	}
+    }
     void append(const K &key, plog_t kh) {
+	tx_count.add(0);
 	pool.root()->keymap->append(key, kh);
     }
 };
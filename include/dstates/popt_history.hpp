@@ -2,86 +2,322 @@
 #define __POPT_HISTORY_T
 
 #include "marker.hpp"
+#include "key_info.hpp"
+#include "simd_search.hpp"
 
+#include <limits>
+#include <utility>
+#include <algorithm>
 #include <libpmemobj++/pool.hpp>
 #include <libpmemobj++/transaction.hpp>
 #include <libpmemobj++/mutex.hpp>
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/make_persistent_array.hpp>
 #include <libpmemobj++/container/array.hpp>
 
 template <class V> class popt_history_t {
     typedef typename std::conditional<std::is_same<V, std::string>::value, pmem::obj::string, V>::type PV;
-    struct entry_t {
-        int ts;
-        PV val;
-        bool marked = false;
+    static const int HISTORY_SIZE = 16, SEGMENTS = 26;
+
+    // Entries past the inline ones go to overflow segments: segment k holds HISTORY_SIZE << k entries
+    // and covers the indices [HISTORY_SIZE << k, HISTORY_SIZE << (k + 1)), like the ekey_history_t directory.
+    // Timestamps, values and marks live in separate arrays, so that the version search scans dense timestamps.
+    struct segment_t {
+        pmem::obj::persistent_ptr<version_t[]> ts;
+        pmem::obj::persistent_ptr<PV[]> vals;
+        pmem::obj::persistent_ptr<bool[]> marked;
+    };
+    struct overflow_t {
+        pmem::obj::array<segment_t, SEGMENTS> segments;
+    };
+
+    // a contiguous run of entries [begin, begin + size): the inline arrays or one overflow segment
+    struct run_t {
+        version_t *ts;
+        PV *vals;
+        bool *marked;
+        int begin, size;
     };
-    static const size_t HISTORY_SIZE = 16;
 
-    pmem::obj::array<entry_t, HISTORY_SIZE> history;
-    pmem::obj::p<int> tail, pending;
+    pmem::obj::array<version_t, HISTORY_SIZE> ts;
+    pmem::obj::array<PV, HISTORY_SIZE> vals;
+    pmem::obj::array<bool, HISTORY_SIZE> marked = {};
+    pmem::obj::persistent_ptr<overflow_t> overflow;
+    pmem::obj::p<int> tail, pending, first;
     pmem::obj::pool_base pool;
     pmem::obj::mutex tx_mutex;
 
+    static int segment_of(int i) {
+        return 31 - __builtin_clz(i / HISTORY_SIZE);
+    }
+
+    static int run_number(int i) {
+        return i < HISTORY_SIZE ? -1 : segment_of(i);
+    }
+
+    // run r is the inline arrays for r = -1, overflow segment r otherwise; false if that segment is not
+    // (or no longer) allocated. Plain pointers for reading only: stores through them are not logged.
+    bool get_run(int r, run_t &run) {
+        if (r < 0) {
+            run = {const_cast<version_t *>(std::as_const(ts).data()), const_cast<PV *>(std::as_const(vals).data()),
+                   const_cast<bool *>(std::as_const(marked).data()), 0, HISTORY_SIZE};
+            return true;
+        }
+        if (overflow == nullptr || overflow->segments[r].ts == nullptr)
+            return false;
+        segment_t &segment = overflow->segments[r];
+        run = {segment.ts.get(), segment.vals.get(), segment.marked.get(), HISTORY_SIZE << r, HISTORY_SIZE << r};
+        return true;
+    }
+
+    bool run_of(int i, run_t &run) {
+        return get_run(run_number(i), run);
+    }
+
+    version_t ts_at(int i) {
+        run_t run;
+        return run_of(i, run) ? run.ts[i - run.begin] : 0;
+    }
+
+    bool marked_at(int i) {
+        run_t run;
+        return run_of(i, run) && run.marked[i - run.begin];
+    }
+
+    // first index in [start, end) with a timestamp > t: a binary search over the first timestamp of each
+    // run picks the run, count_le() finishes inside it. Freed segments count as older than any t.
+    int upper(version_t t, int start, int end) {
+        if (start >= end)
+            return start;
+        int left = run_number(start), right = run_number(end - 1) + 1, lowest = left;
+        run_t run;
+        while (left < right) {
+            int middle = left + (right - left) / 2;
+            if (!get_run(middle, run) || run.ts[std::max(start, run.begin) - run.begin] <= t)
+                left = middle + 1;
+            else
+                right = middle;
+        }
+        if (left == lowest)
+            return start;
+        int r = left - 1, stop = r < 0 ? HISTORY_SIZE : HISTORY_SIZE << (r + 1);
+        if (!get_run(r, run))
+            return std::min(end, stop);
+        int begin = std::max(start, run.begin);
+        stop = std::min(end, stop);
+        return begin + count_le(run.ts + begin - run.begin, stop - begin, t);
+    }
+
+    // advances the tail over the marked entries with timestamp <= t, then finds the newest entry at or below t
+    bool locate(version_t t, run_t &run, int &offset) {
+        pmem::obj::transaction::run(pool, [&] {
+            while (marked_at(tail) && ts_at(tail) <= t)
+                tail++;
+        }, tx_mutex);
+        int start = first, i = upper(t, start, tail);
+        if (i == start || !run_of(i - 1, run))
+            return false;
+        offset = i - 1 - run.begin;
+        return true;
+    }
+
+    // calls f(ts, value) for the marked entries from begin on, up to the first one newer than to
+    template <typename F> void scan(int begin, version_t to, F &&f) {
+        run_t run;
+        for (int i = begin; run_of(i, run); i = run.begin + run.size)
+            for (int j = i - run.begin; j < run.size; j++) {
+                if (!run.marked[j] || run.ts[j] > to)
+                    return;
+                f(run.ts[j], get_view(run.vals[j]));
+            }
+    }
+
+    void free_segment(int k) {
+        segment_t &segment = overflow->segments[k];
+        pmem::obj::delete_persistent<version_t[]>(segment.ts, HISTORY_SIZE << k);
+        pmem::obj::delete_persistent<PV[]>(segment.vals, HISTORY_SIZE << k);
+        pmem::obj::delete_persistent<bool[]>(segment.marked, HISTORY_SIZE << k);
+        segment.ts = nullptr;
+        segment.vals = nullptr;
+        segment.marked = nullptr;
+    }
+
 public:
+    // tag of this layout in the pool root, see pmem_history_t
+    static constexpr uint8_t LAYOUT = 2;
+
+    // a history written before 64-bit versions and the structure-of-arrays layout: one array of
+    // {int ts; PV val; bool marked} entries without overflow, then the {int version; bool removed} info word.
+    // Only read by pmem_history_t::migrate(), which rewrites it as a popt_history_t.
+    struct legacy_t {
+        struct entry_t {
+            int32_t ts;
+            PV val;
+            bool marked;
+        };
+        pmem::obj::array<entry_t, HISTORY_SIZE> history;
+        pmem::obj::p<int> tail, pending;
+        pmem::obj::pool_base pool;
+        pmem::obj::mutex tx_mutex;
+        int32_t version;
+        bool removed;
+
+        // calls f(ts, value) for every marked entry, without adding the entries to a transaction
+        template <typename F> void for_each(F &&f) {
+            auto &entries = std::as_const(history);
+            for (int i = 0; i < HISTORY_SIZE && entries[i].marked; i++)
+                f(entries[i].ts, get_view(entries[i].val));
+        }
+    };
+
     key_info_t info;
 
     popt_history_t() {
         pool = pmem::obj::pool_by_vptr(this);
         pmem::obj::transaction::run(pool, [&] {
-            while (history[tail].marked)
+            while (marked_at(tail))
                 tail++;
         }, tx_mutex);
-        if (tail > 0)
-            info.update(history[tail - 1].ts, history[tail - 1].val == marker_t<V>::low_marker);
+        run_t run;
+        if (tail > 0 && run_of(tail - 1, run))
+            info.update(run.ts[tail - 1 - run.begin], run.vals[tail - 1 - run.begin] == marker_t<V>::low_marker);
+    }
+
+    // runs inside the delete_persistent transaction
+    ~popt_history_t() {
+        if (overflow == nullptr)
+            return;
+        for (int k = 0; k < SEGMENTS; k++)
+            if (overflow->segments[k].ts != nullptr)
+                free_segment(k);
+        pmem::obj::delete_persistent<overflow_t>(overflow);
     }
 
-    void insert(int t, const V &v) {
+    void insert(version_t t, const V &v) {
         int slot;
         pmem::obj::transaction::run(pool, [&] {
             slot = pending++;
+            if (slot < HISTORY_SIZE)
+                return;
+            int k = segment_of(slot);
+            if (k >= SEGMENTS)
+                throw std::runtime_error("history full, maximum number of overflow segments reached");
+            if (overflow == nullptr)
+                overflow = pmem::obj::make_persistent<overflow_t>();
+            segment_t &segment = overflow->segments[k];
+            if (segment.ts == nullptr) {
+                segment.ts = pmem::obj::make_persistent<version_t[]>(HISTORY_SIZE << k);
+                segment.vals = pmem::obj::make_persistent<PV[]>(HISTORY_SIZE << k);
+                segment.marked = pmem::obj::make_persistent<bool[]>(HISTORY_SIZE << k);
+            }
         }, tx_mutex);
-        if (slot == HISTORY_SIZE)
-            throw std::runtime_error("history full, reallocation not implemented yet");
         pmem::obj::transaction::run(pool, [&] {
-            history[slot].ts = t;
-            history[slot].val = v;
-            history[slot].marked = true;
+            // the non-const accessors of the inline arrays add the written elements to the transaction
+            if (slot < HISTORY_SIZE) {
+                ts[slot] = t;
+                vals[slot] = v;
+                marked[slot] = true;
+                return;
+            }
+            int k = segment_of(slot), offset = slot - (HISTORY_SIZE << k);
+            version_t *pts = overflow->segments[k].ts.get();
+            PV *pvals = overflow->segments[k].vals.get();
+            bool *pmarked = overflow->segments[k].marked.get();
+            // plain arrays of a segment allocated by an earlier transaction: log the old contents first,
+            // pmem::obj::string values log themselves on assignment
+            pmem::obj::transaction::snapshot(&pts[offset]);
+            pmem::obj::transaction::snapshot(&pmarked[offset]);
+            if constexpr (std::is_trivially_copyable<PV>::value)
+                pmem::obj::transaction::snapshot(&pvals[offset]);
+            pts[offset] = t;
+            pvals[offset] = v;
+            pmarked[offset] = true;
         });
         info.update(t, v == marker_t<V>::low_marker);
     }
 
-    void remove(int t) {
+    void remove(version_t t) {
         insert(t, marker_t<V>::low_marker);
     }
 
-    V find(int t) {
+    V find(version_t t) {
+        run_t run;
+        int offset;
+        return locate(t, run, offset) ? get_volatile(run.vals[offset]) : marker_t<V>::low_marker;
+    }
+
+    // calls f(value) in place if a value is visible at version t
+    template <typename F> void visit(version_t t, F &&f) {
+        run_t run;
+        int offset;
+        if (locate(t, run, offset) && run.vals[offset] != marker_t<V>::low_marker)
+            f(get_view(run.vals[offset]));
+    }
+
+    // calls f(ts, value) in place for every marked entry
+    template <typename F> void for_each(F &&f) {
+        scan(first, std::numeric_limits<version_t>::max(), f);
+    }
+
+    // same as for_each, restricted to the entries with from <= ts <= to: seeks to from by binary search
+    // over the fully written prefix, then continues over the marked entries that follow it
+    template <typename F> void for_each(version_t from, version_t to, F &&f) {
+        int start = from > std::numeric_limits<version_t>::min() ? upper(from - 1, first, tail) : (int)first;
+        scan(start, to, [&](version_t ts, const auto &val) {
+            if (ts >= from)
+                f(ts, val);
+        });
+    }
+
+    template <typename T> void copy_to(std::vector<std::pair<T, V>> &result) {
+        for_each([&](version_t ts, const auto &val) {
+            result.emplace_back(ts, val);
+        });
+    }
+
+    template <typename T> void copy_to(version_t from, version_t to, std::vector<std::pair<T, V>> &result) {
+        for_each(from, to, [&](version_t ts, const auto &val) {
+            result.emplace_back(ts, val);
+        });
+    }
+
+    // drops the entries older than the newest one at or below t. Only the first index moves: readers hold
+    // tx_mutex only while locate() advances the tail and read the entries after releasing it, so the entries
+    // stay in place and purge() frees the overflow segments left behind.
+    // The inline slots below the first index are not reused. Skipped while an insert has reserved a slot
+    // without having written it yet.
+    size_t truncate_before(version_t t) {
+        // nothing to drop, no transaction: an unwritten slot passes and is caught below
+        if (first + 1 >= pending || ts_at(first + 1) > t)
+            return 0;
+        int dropped = 0;
         pmem::obj::transaction::run(pool, [&] {
-            while (history[tail].marked && history[tail].ts <= t)
-                tail++;
+            for (int i = tail; i < pending; i++)
+                if (!marked_at(i))
+                    return;
+            if (pending == first || ts_at(first) > t)
+                return;
+            int keep = upper(t, first, pending) - 1;
+            dropped = keep - first;
+            if (dropped > 0)
+                first = keep;
         }, tx_mutex);
-        int left = 0, right = tail - 1;
-        while (left <= right) {
-            int middle = (left + right) / 2;
-            if (t < history[middle].ts)
-                right = middle - 1;
-            else if (t > history[middle].ts)
-                left = middle + 1;
-            else
-                return get_volatile(history[middle].val);
-        }
-        return (right < 0) ? marker_t<V>::low_marker : get_volatile(history[right].val);
+        return dropped;
     }
 
-    void copy_to(std::vector<std::pair<int, V>> &result) {
-        int current_head = 0;
-        while (history[current_head].marked) {
-            result.emplace_back(std::make_pair(history[current_head].ts, get_volatile(history[current_head].val)));
-            current_head++;
-        }
+    // frees the overflow segments that lie entirely below the first entry, once no reader can access them
+    void purge() {
+        if (overflow == nullptr)
+            return;
+        pmem::obj::transaction::run(pool, [&] {
+            for (int k = 0; k < SEGMENTS && (HISTORY_SIZE << (k + 1)) <= first; k++)
+                if (overflow->segments[k].ts != nullptr)
+                    free_segment(k);
+        }, tx_mutex);
     }
 
     size_t size() {
-        return tail;
+        return pending - first;
     }
 };
 
@@ -0,0 +1,83 @@
+#ifndef __SERIALIZER
+#define __SERIALIZER
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+// Minimal binary encoding for keys and values: trivially copyable types are copied as is,
+// strings are prefixed by their length.
+template <class T> void serialize(std::vector<char> &buf, const T &v) {
+    static_assert(std::is_trivially_copyable<T>::value, "no serializer for this type");
+    const char *p = reinterpret_cast<const char *>(&v);
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+inline void serialize(std::vector<char> &buf, std::string_view v) {
+    uint32_t len = v.size();
+    serialize(buf, len);
+    buf.insert(buf.end(), v.begin(), v.end());
+}
+
+inline void serialize(std::vector<char> &buf, const std::string &v) {
+    serialize(buf, std::string_view(v));
+}
+
+// reads v at p, returns the position right after it
+template <class T> const char *deserialize(const char *p, T &v) {
+    static_assert(std::is_trivially_copyable<T>::value, "no serializer for this type");
+    std::memcpy(&v, p, sizeof(T));
+    return p + sizeof(T);
+}
+
+inline const char *deserialize(const char *p, std::string &v) {
+    uint32_t len;
+    p = deserialize(p, len);
+    v.assign(p, len);
+    return p + len;
+}
+
+// points v into the buffer instead of copying, valid as long as the buffer
+inline const char *deserialize(const char *p, std::string_view &v) {
+    uint32_t len;
+    p = deserialize(p, len);
+    v = std::string_view(p, len);
+    return p + len;
+}
+
+// same as above for untrusted input: returns nullptr instead of reading past end
+template <class T> const char *deserialize(const char *p, const char *end, T &v) {
+    if ((size_t)(end - p) < sizeof(T))
+        return nullptr;
+    return deserialize(p, v);
+}
+
+template <class S> const char *deserialize_str(const char *p, const char *end, S &v) {
+    uint32_t len;
+    p = deserialize(p, end, len);
+    if (p == nullptr || (size_t)(end - p) < len)
+        return nullptr;
+    v = S(p, len);
+    return p + len;
+}
+
+inline const char *deserialize(const char *p, const char *end, std::string &v) {
+    return deserialize_str(p, end, v);
+}
+
+inline const char *deserialize(const char *p, const char *end, std::string_view &v) {
+    return deserialize_str(p, end, v);
+}
+
+// FNV-1a over size bytes at p, seed is mixed into the initial state
+inline uint32_t checksum(const char *p, size_t size, uint32_t seed = 0) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ (uint8_t)p[i]) * 16777619u;
+    return h;
+}
+
+#endif // __SERIALIZER
@@ -0,0 +1,219 @@
+#ifndef __SHARDED_KV
+#define __SHARDED_KV
+
+#include "vordered_kv.hpp"
+#include "numa.hpp"
+
+#include <omp.h>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <shared_mutex>
+
+// Range-partitioned front end over several vordered_kv_t shards, each with its own pool (so that each pool
+// can live on its own device or NUMA node). Shard i holds the keys in [splits[i - 1], splits[i]). All shards
+// read and tag one shared version clock, so versions mean the same as in a single store. Placement is by
+// key, not by thread: put the pool of each shard on a device of some node and pass the nodes to the
+// constructor. Writes are then NUMA-local only for writers that keep to the key ranges of their node's
+// shards, found with local_shards() or pinned with bind_to_shard(). Any other writer reaches remote pools.
+template <typename K, typename V, typename P = pmem_history_t <K, V>, bool use_shortcuts = true> class sharded_kv_t {
+    typedef vordered_kv_t<K, V, P, use_shortcuts> shard_t;
+
+    alignas(64) std::atomic<version_t> clock{0};
+    std::vector<K> splits;
+    std::vector<std::unique_ptr<shard_t>> shards;
+    std::vector<int> nodes;
+    std::shared_mutex tag_mutex;
+
+    size_t shard_of(const K &key) {
+        return std::upper_bound(splits.begin(), splits.end(), key) - splits.begin();
+    }
+
+public:
+    // nodes[i] is the NUMA node of the device holding dbs[i], or -1 if unknown; empty means all unknown
+    sharded_kv_t(const std::vector<std::string> &dbs, const std::vector<K> &splits, bool persist_index = false,
+                 size_t pool_size = 0, const std::vector<int> &nodes = {}) :
+        splits(splits), nodes(nodes) {
+        if (dbs.size() != splits.size() + 1 || !std::is_sorted(splits.begin(), splits.end()))
+            throw std::invalid_argument("sharded_kv_t needs one more pool than sorted split keys");
+        if (!nodes.empty() && nodes.size() != dbs.size())
+            throw std::invalid_argument("sharded_kv_t needs one node per pool");
+        this->nodes.resize(dbs.size(), -1);
+        for (auto &db : dbs)
+            shards.emplace_back(new shard_t(db, persist_index, false, &clock, pool_size));
+    }
+
+    size_t size() {
+        return shards.size();
+    }
+
+    shard_t &shard(size_t i) {
+        return *shards[i];
+    }
+
+    int node_of(size_t i) {
+        return nodes[i];
+    }
+
+    // the shards whose pool sits on the given node, by default the node of the calling thread
+    std::vector<size_t> local_shards(int node = numa::current_node()) {
+        std::vector<size_t> result;
+        for (size_t i = 0; i < shards.size(); i++)
+            if (nodes[i] == node)
+                result.push_back(i);
+        return result;
+    }
+
+    // pins the calling thread to the node of shard i, so that its writes to that shard stay local.
+    // False if the node is unknown or the thread may not run there.
+    bool bind_to_shard(size_t i) {
+        return nodes[i] >= 0 && numa::bind_to_node(nodes[i]);
+    }
+
+    bool insert(const K &key, const V &value) {
+        return shards[shard_of(key)]->insert(key, value);
+    }
+
+    bool remove(const K &key) {
+        return shards[shard_of(key)]->remove(key);
+    }
+
+    V find(version_t v, const K &key) {
+        return shards[shard_of(key)]->find(v, key);
+    }
+
+    // the shards are disjoint key ranges in ascending order, so visiting them in turn keeps the key order
+    template <typename F> void visit_snapshot(version_t v, F &&f) {
+        for (auto &shard : shards)
+            shard->visit_snapshot(v, f);
+    }
+
+    template <typename F> void visit_range(version_t v, const K &lo, const K &hi, F &&f) {
+        for (size_t i = shard_of(lo), last = shard_of(hi); i <= last && i < shards.size(); i++)
+            shards[i]->visit_range(v, lo, hi, f);
+    }
+
+    // with threads > 1, the shards are extracted in parallel and concatenated in order. Nested parallel
+    // regions are off, so up to one thread per shard extracts whole shards, more threads split each shard in turn.
+    void get_snapshot(version_t v, std::vector<std::pair<K, V>> &result, int threads = 1) {
+        result.clear();
+        if (threads <= 1) {
+            visit_snapshot(v, [&](const K &key, const auto &val) {
+                result.emplace_back(key, val);
+            });
+            return;
+        }
+        int n = shards.size();
+        std::vector<std::vector<std::pair<K, V>>> parts(n);
+        if (threads <= n) {
+            #pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+            for (int i = 0; i < n; i++)
+                shards[i]->get_snapshot(v, parts[i], 1);
+        } else
+            for (int i = 0; i < n; i++)
+                shards[i]->get_snapshot(v, parts[i], threads);
+        size_t total = 0;
+        for (auto &part : parts)
+            total += part.size();
+        result.reserve(total);
+        for (auto &part : parts)
+            std::move(part.begin(), part.end(), std::back_inserter(result));
+    }
+
+    void get_range(version_t v, const K &lo, const K &hi, std::vector<std::pair<K, V>> &result) {
+        result.clear();
+        visit_range(v, lo, hi, [&](const K &key, const auto &val) {
+            result.emplace_back(key, val);
+        });
+    }
+
+    template <typename T> void get_key_history(const K &key, std::vector<std::pair<T, V>> &result) {
+        shards[shard_of(key)]->get_key_history(key, result);
+    }
+
+    template <typename T> void get_key_history(const K &key, version_t from, version_t to, std::vector<std::pair<T, V>> &result) {
+        shards[shard_of(key)]->get_key_history(key, from, to, result);
+    }
+
+    void get_changes(version_t v1, version_t v2, std::vector<std::tuple<K, V, V>> &result) {
+        result.clear();
+        for (auto &shard : shards)
+            shard->visit_changes(v1, v2, [&](const K &key, const V &before, const V &after) {
+                result.emplace_back(key, before, after);
+            });
+    }
+
+    version_t latest() {
+        return clock;
+    }
+
+    // every shard records the new clock, so that a restart resumes from it without newer updates
+    version_t tag() {
+        std::unique_lock<std::shared_mutex> lock(tag_mutex);
+        version_t v = clock++;
+        for (auto &shard : shards)
+            shard->pool_tag(v + 1);
+        return v;
+    }
+
+    // applies the batch at the version after the current one, then moves the clock there, see
+    // vordered_kv_t::write_batch: readers see the whole batch or none of it. The shards commit to separate
+    // pools, so a batch spanning several of them could not be all-or-nothing. All its keys must belong to
+    // one shard, otherwise it is rejected with std::invalid_argument before anything is written.
+    version_t write_batch(const write_batch_t<K, V> &batch) {
+        write_batch_t<K, V> sorted = batch;
+        sorted.sort();
+        size_t i = sorted.size() > 0 ? shard_of(sorted.begin()->first) : 0;
+        if (sorted.size() > 0 && shard_of(std::prev(sorted.end())->first) != i)
+            throw std::invalid_argument("sharded_kv_t::write_batch needs all keys of the batch in one shard");
+        std::unique_lock<std::shared_mutex> lock(tag_mutex);
+        shards[i]->block_writes();
+        version_t v = clock + 1;
+        try {
+            shards[i]->stage_batch(sorted, v);
+            clock.store(v);
+            // as in tag(), every shard records the clock, the batch may have written no entry at v
+            for (auto &shard : shards)
+                shard->pool_tag(v);
+        } catch (...) {
+            shards[i]->allow_writes();
+            throw;
+        }
+        shards[i]->allow_writes();
+        return v;
+    }
+
+    size_t reclaim(version_t watermark) {
+        size_t reclaimed = 0;
+        for (auto &shard : shards)
+            reclaimed += shard->reclaim(watermark);
+        return reclaimed;
+    }
+
+    size_t truncate_before(version_t watermark) {
+        size_t dropped = 0;
+        for (auto &shard : shards)
+            dropped += shard->truncate_before(watermark);
+        return dropped;
+    }
+
+    void clear_stats() {
+        for (auto &shard : shards)
+            shard->clear_stats();
+    }
+
+    // per shard, in shard order
+    const std::string get_stats(bool json = false, bool walk = false) {
+        std::string out = json ? "[" : "";
+        for (size_t i = 0; i < shards.size(); i++) {
+            if (i > 0)
+                out += json ? ", " : "\n";
+            out += json ? shards[i]->get_stats(true, walk) : "shard " + std::to_string(i) + ": " + shards[i]->get_stats(false, walk);
+        }
+        return json ? out + "]" : out;
+    }
+};
+
+#endif // __SHARDED_KV
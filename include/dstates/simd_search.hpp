@@ -0,0 +1,65 @@
+#ifndef __SIMD_SEARCH
+#define __SIMD_SEARCH
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Number of timestamps <= t in the sorted array ts[0, n), i.e. the upper bound of t. History blocks are
+// small, so a branch-free count over whole vectors beats a binary search with its unpredictable branches.
+inline size_t count_le(const int32_t *ts, size_t n, int32_t t) {
+    size_t i = 0, count = 0;
+#if defined(__AVX2__)
+    __m256i key = _mm256_set1_epi32(t);
+    for (; i + 8 <= n; i += 8) {
+        __m256i gt = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(ts + i)), key);
+        count += 8 - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+    }
+#elif defined(__SSE2__)
+    __m128i key = _mm_set1_epi32(t);
+    for (; i + 4 <= n; i += 4) {
+        __m128i gt = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(ts + i)), key);
+        count += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(gt)));
+    }
+#endif
+    for (; i < n; i++)
+        count += ts[i] <= t;
+    return count;
+}
+
+// 64-bit variant. SSE2 has no 64-bit compare, so there it is built from 32-bit ones: a > t if the signed
+// high halves compare greater, or they are equal and the low halves compare greater unsigned.
+inline size_t count_le(const int64_t *ts, size_t n, int64_t t) {
+    size_t i = 0, count = 0;
+#if defined(__AVX2__)
+    __m256i key = _mm256_set1_epi64x(t);
+    for (; i + 4 <= n; i += 4) {
+        __m256i gt = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *)(ts + i)), key);
+        count += 4 - __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(gt)));
+    }
+#elif defined(__SSE4_2__)
+    __m128i key = _mm_set1_epi64x(t);
+    for (; i + 2 <= n; i += 2) {
+        __m128i gt = _mm_cmpgt_epi64(_mm_loadu_si128((const __m128i *)(ts + i)), key);
+        count += 2 - __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(gt)));
+    }
+#elif defined(__SSE2__)
+    // flipping the sign bit of the low halves turns their signed compare into an unsigned one
+    __m128i bias = _mm_set1_epi64x(0x80000000), key = _mm_set1_epi64x(t), biased_key = _mm_xor_si128(key, bias);
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(ts + i));
+        __m128i gt = _mm_cmpgt_epi32(_mm_xor_si128(a, bias), biased_key), eq = _mm_cmpeq_epi32(a, key);
+        // the low half result moves up next to the high half, the sign of which movemask reads
+        gt = _mm_or_si128(gt, _mm_and_si128(eq, _mm_shuffle_epi32(gt, _MM_SHUFFLE(2, 2, 0, 0))));
+        count += 2 - __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(gt)));
+    }
+#endif
+    for (; i < n; i++)
+        count += ts[i] <= t;
+    return count;
+}
+
+#endif // __SIMD_SEARCH
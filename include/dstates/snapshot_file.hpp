@@ -0,0 +1,366 @@
+#ifndef __SNAPSHOT_FILE
+#define __SNAPSHOT_FILE
+
+#include "marker.hpp"
+#include "version.hpp"
+#include "serializer.hpp"
+#include "sync_dir.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Immutable snapshot file: the (key, value) pairs of one version in key order, encoded with
+// serialize() and grouped in blocks of block_size entries. An index of block offsets and an
+// optional Bloom filter over the keys follow the blocks, the header points to both.
+namespace snapshot_file {
+    inline const char MAGIC[8] = {'v', 'o', 'r', 'd', 's', 'n', 'a', 'p'};
+    static const uint32_t BLOOM_HASHES = 7, BLOOM_BITS_PER_KEY = 10;
+
+    struct header_t {
+        char magic[8];
+        uint32_t block_size, bloom_hashes;
+        int64_t version;
+        uint64_t count, blocks, data_end, index_offset, bloom_offset, bloom_bits;
+    };
+
+    // double hashing over the encoded key, so that writer and reader agree on any platform
+    inline void bloom_hashes(const std::vector<char> &key, uint32_t &h1, uint32_t &h2) {
+        h1 = checksum(key.data(), key.size());
+        h2 = checksum(key.data(), key.size(), 0x9e3779b9) | 1;
+    }
+}
+
+// Streams pairs in ascending key order into a snapshot file. The file is written under a temporary
+// name and renamed by finish(), so that readers never see a partial snapshot, and the rename is synced.
+template <typename K, typename V> class snapshot_writer_t {
+    std::string path;
+    FILE *file;
+    bool bloom;
+    uint32_t block_size;
+    uint64_t count = 0, offset = 0;
+    K last; // key of the previous append, keys must be strictly ascending
+    std::vector<uint64_t> index;
+    std::vector<std::pair<uint32_t, uint32_t>> hashes;
+    std::vector<char> buf;
+
+    void write(const void *data, size_t size) {
+        if (fwrite(data, 1, size, file) != size)
+            throw std::runtime_error("cannot write snapshot " + path + ": " + strerror(errno));
+        offset += size;
+    }
+
+public:
+    snapshot_writer_t(const std::string &path, bool bloom = true, uint32_t block_size = 64) :
+        path(path), bloom(bloom), block_size(block_size) {
+        file = fopen((path + ".tmp").c_str(), "wb");
+        if (file == nullptr)
+            throw std::runtime_error("cannot create snapshot " + path + ": " + strerror(errno));
+        snapshot_file::header_t header = {};
+        write(&header, sizeof(header));
+    }
+    snapshot_writer_t(const snapshot_writer_t &) = delete;
+    ~snapshot_writer_t() {
+        if (file != nullptr) {
+            fclose(file);
+            std::remove((path + ".tmp").c_str());
+        }
+    }
+
+    template <typename KV, typename VV> void append(const KV &key, const VV &val) {
+        if (count > 0 && !(last < key))
+            throw std::runtime_error("cannot write snapshot " + path + ": keys not in ascending order");
+        last = K(key);
+        if (count % block_size == 0)
+            index.push_back(offset);
+        buf.clear();
+        serialize(buf, key);
+        if (bloom) {
+            uint32_t h1, h2;
+            snapshot_file::bloom_hashes(buf, h1, h2);
+            hashes.emplace_back(h1, h2);
+        }
+        serialize(buf, val);
+        write(buf.data(), buf.size());
+        count++;
+    }
+
+    // writes the index, the Bloom filter and the header, then publishes the file. Returns the number of pairs.
+    size_t finish(version_t version) {
+        snapshot_file::header_t header = {};
+        std::memcpy(header.magic, snapshot_file::MAGIC, sizeof(header.magic));
+        header.bloom_hashes = snapshot_file::BLOOM_HASHES;
+        header.block_size = block_size;
+        header.version = version;
+        header.count = count;
+        header.blocks = index.size();
+        header.data_end = offset;
+        uint64_t zero = 0;
+        write(&zero, (8 - offset % 8) % 8);
+        header.index_offset = offset;
+        write(index.data(), index.size() * sizeof(uint64_t));
+        header.bloom_offset = offset;
+        if (bloom) {
+            header.bloom_bits = (std::max<uint64_t>(count * snapshot_file::BLOOM_BITS_PER_KEY, 64) + 63) / 64 * 64;
+            std::vector<uint64_t> bits(header.bloom_bits / 64);
+            for (auto &h : hashes)
+                for (uint32_t i = 0; i < snapshot_file::BLOOM_HASHES; i++) {
+                    uint64_t bit = (h.first + (uint64_t)i * h.second) % header.bloom_bits;
+                    bits[bit / 64] |= 1UL << (bit % 64);
+                }
+            write(bits.data(), bits.size() * sizeof(uint64_t));
+        }
+        if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1
+            || fflush(file) != 0 || fsync(fileno(file)) != 0)
+            throw std::runtime_error("cannot write snapshot " + path + ": " + strerror(errno));
+        fclose(file);
+        file = nullptr;
+        if (std::rename((path + ".tmp").c_str(), path.c_str()) != 0)
+            throw std::runtime_error("cannot publish snapshot " + path + ": " + strerror(errno));
+        sync_parent_dir(path);
+        return count;
+    }
+};
+
+// Read-only snapshot file mapped with mmap. Keys and values are read in place: trivially copyable types
+// are copied out of the mapping, strings are served as std::string_view into it, valid while the file is open.
+template <typename K, typename V> class snapshot_file_t {
+    template <typename T> using view_t = typename std::conditional<std::is_same<T, std::string>::value, std::string_view, T>::type;
+    typedef view_t<K> key_view_t;
+    typedef view_t<V> val_view_t;
+
+    int fd = -1;
+    const char *base = nullptr;
+    size_t length = 0;
+    const snapshot_file::header_t *header;
+    const uint64_t *index, *bloom;
+
+    // every offset of the header and the index must stay inside the mapping, so that a truncated
+    // or corrupted file is rejected instead of read out of bounds. The blocks are walked once: each
+    // must start where the previous one ended and hold whole records, so later reads need no bounds.
+    bool valid() const {
+        if (std::memcmp(header->magic, snapshot_file::MAGIC, sizeof(header->magic)) != 0
+            || header->data_end < sizeof(snapshot_file::header_t) || header->data_end > header->index_offset
+            || header->index_offset % sizeof(uint64_t) != 0 || header->index_offset > length
+            || header->blocks > (length - header->index_offset) / sizeof(uint64_t)
+            || header->bloom_offset % sizeof(uint64_t) != 0 || header->bloom_offset > length
+            || header->bloom_bits % 64 != 0 || header->bloom_bits / 8 > length - header->bloom_offset
+            || (header->bloom_bits != 0 && header->bloom_hashes == 0))
+            return false;
+        const uint64_t *offsets = (const uint64_t *)(base + header->index_offset);
+        const char *p = base + sizeof(snapshot_file::header_t);
+        uint64_t count = 0;
+        for (size_t b = 0; b < header->blocks; b++) {
+            uint64_t next = b + 1 < header->blocks ? offsets[b + 1] : header->data_end;
+            if (offsets[b] != (uint64_t)(p - base) || next <= offsets[b] || next > header->data_end)
+                return false;
+            const char *end = base + next;
+            while (p != nullptr && p < end) {
+                key_view_t key;
+                val_view_t val;
+                p = deserialize(p, end, key);
+                p = p == nullptr ? p : deserialize(p, end, val);
+                count++;
+            }
+            if (p != end)
+                return false;
+        }
+        return p == base + header->data_end && count == header->count;
+    }
+
+    const char *block(size_t b) const {
+        return base + (b < header->blocks ? index[b] : header->data_end);
+    }
+
+    bool may_contain(const K &key) const {
+        if (header->bloom_bits == 0)
+            return true;
+        std::vector<char> buf;
+        serialize(buf, key);
+        uint32_t h1, h2;
+        snapshot_file::bloom_hashes(buf, h1, h2);
+        for (uint32_t i = 0; i < header->bloom_hashes; i++) {
+            uint64_t bit = (h1 + (uint64_t)i * h2) % header->bloom_bits;
+            if (!(bloom[bit / 64] & (1UL << (bit % 64))))
+                return false;
+        }
+        return true;
+    }
+
+    // start of the block that holds key if it is present: the last one whose first key is <= key
+    const char *seek(const K &key) const {
+        size_t left = 0, right = header->blocks;
+        while (left < right) {
+            size_t middle = left + (right - left) / 2;
+            key_view_t first;
+            deserialize(block(middle), first);
+            if (first <= key)
+                left = middle + 1;
+            else
+                right = middle;
+        }
+        return block(left > 0 ? left - 1 : 0);
+    }
+
+    // calls f(key, value) for the entries from p on while f returns true
+    template <typename F> void scan(const char *p, F &&f) const {
+        const char *end = block(header->blocks);
+        while (p < end) {
+            key_view_t key;
+            val_view_t val;
+            p = deserialize(deserialize(p, key), val);
+            if (!f(key, val))
+                return;
+        }
+    }
+
+public:
+    // materializes one pair at a time, so that bulk_load() can consume a file directly
+    class iterator_t {
+        const snapshot_file_t *file;
+        const char *p;
+        std::pair<K, V> current;
+
+        void load() {
+            if (p < file->block(file->header->blocks))
+                deserialize(deserialize(p, current.first), current.second);
+        }
+
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef std::pair<K, V> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type *pointer;
+        typedef const value_type &reference;
+
+        iterator_t(const snapshot_file_t *file, const char *p) : file(file), p(p) {
+            load();
+        }
+        reference operator*() const {
+            return current;
+        }
+        pointer operator->() const {
+            return &current;
+        }
+        iterator_t &operator++() {
+            key_view_t key;
+            val_view_t val;
+            p = deserialize(deserialize(p, key), val);
+            load();
+            return *this;
+        }
+        bool operator==(const iterator_t &other) const {
+            return p == other.p;
+        }
+        bool operator!=(const iterator_t &other) const {
+            return p != other.p;
+        }
+    };
+
+    snapshot_file_t(const std::string &path) {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open snapshot " + path + ": " + strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            int err = errno;
+            close(fd);
+            throw std::runtime_error("cannot open snapshot " + path + ": " + strerror(err));
+        }
+        length = st.st_size;
+        void *addr = length < sizeof(snapshot_file::header_t) ? MAP_FAILED : mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("cannot map snapshot " + path);
+        }
+        base = (const char *)addr;
+        header = (const snapshot_file::header_t *)base;
+        if (!valid()) {
+            munmap((void *)base, length);
+            close(fd);
+            throw std::runtime_error("not a snapshot file: " + path);
+        }
+        index = (const uint64_t *)(base + header->index_offset);
+        bloom = (const uint64_t *)(base + header->bloom_offset);
+    }
+    snapshot_file_t(const snapshot_file_t &) = delete;
+    ~snapshot_file_t() {
+        munmap((void *)base, length);
+        close(fd);
+    }
+
+    version_t version() const {
+        return header->version;
+    }
+    size_t size() const {
+        return header->count;
+    }
+
+    // calls f(value) in place if key is present
+    template <typename F> bool visit(const K &key, F &&f) const {
+        if (!may_contain(key))
+            return false;
+        bool found = false;
+        scan(seek(key), [&](const key_view_t &curr, const val_view_t &val) {
+            if (curr < key)
+                return true;
+            if (curr == key) {
+                f(val);
+                found = true;
+            }
+            return false;
+        });
+        return found;
+    }
+
+    V find(const K &key) const {
+        V result = marker_t<V>::low_marker;
+        visit(key, [&](const val_view_t &val) {
+            result = V(val);
+        });
+        return result;
+    }
+
+    // calls f(key, value) in place for the keys in [lo, hi), in key order
+    template <typename F> void visit_range(const K &lo, const K &hi, F &&f) const {
+        scan(seek(lo), [&](const key_view_t &key, const val_view_t &val) {
+            if (!(key < hi))
+                return false;
+            if (!(key < lo))
+                f(key, val);
+            return true;
+        });
+    }
+
+    template <typename F> void visit_all(F &&f) const {
+        scan(block(0), [&](const key_view_t &key, const val_view_t &val) {
+            f(key, val);
+            return true;
+        });
+    }
+
+    void get_range(const K &lo, const K &hi, std::vector<std::pair<K, V>> &result) const {
+        result.clear();
+        visit_range(lo, hi, [&](const key_view_t &key, const val_view_t &val) {
+            result.emplace_back(K(key), V(val));
+        });
+    }
+
+    iterator_t begin() const {
+        return iterator_t(this, block(0));
+    }
+    iterator_t end() const {
+        return iterator_t(this, block(header->blocks));
+    }
+};
+
+#endif // __SNAPSHOT_FILE
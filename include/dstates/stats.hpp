@@ -0,0 +1,101 @@
+#ifndef __STATS
+#define __STATS
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <sstream>
+#include <functional>
+
+// Per-thread event counters: each thread adds to the counters of its own cache line, so counting
+// costs one uncontended relaxed increment. Totals are summed up on demand.
+template <size_t N> class counters_t {
+    static const size_t SLOTS = 64;
+
+    struct alignas(64) slot_t {
+        std::atomic<long> values[N] = {};
+    };
+
+    slot_t slots[SLOTS];
+
+    static size_t thread_slot() {
+        static thread_local size_t slot = std::hash<std::thread::id>()(std::this_thread::get_id()) % SLOTS;
+        return slot;
+    }
+
+public:
+    void add(size_t counter, long n = 1) {
+        slots[thread_slot()].values[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    long get(size_t counter) const {
+        long total = 0;
+        for (size_t i = 0; i < SLOTS; i++)
+            total += slots[i].values[counter].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < SLOTS; i++)
+            for (size_t j = 0; j < N; j++)
+                slots[i].values[j].store(0, std::memory_order_relaxed);
+    }
+};
+
+// snapshot of the vordered_kv_t counters since the last clear_stats(), plus the current history lengths
+// when asked for a walk
+struct stats_t {
+    enum counter_t {
+        INSERTS, REMOVES, FINDS, SCANS, INSERT_RETRIES, SEARCHES, NODES_VISITED,
+        SHORTCUT_HITS, SHORTCUT_MISSES, HISTORY_WRITES, SCRUB_PASSES, COUNTERS
+    };
+
+    long inserts = 0, removes = 0, finds = 0, scans = 0, insert_retries = 0;
+    long searches = 0, nodes_visited = 0, shortcut_hits = 0, shortcut_misses = 0;
+    long history_writes = 0, scrub_passes = 0, pool_transactions = 0;
+    long keys = 0, history_entries = 0, max_history = 0, stale_shortcuts = 0;
+
+    template <typename F> void for_each(F &&f) const {
+        f("inserts", inserts);
+        f("removes", removes);
+        f("finds", finds);
+        f("scans", scans);
+        f("insert_retries", insert_retries);
+        f("searches", searches);
+        f("nodes_visited", nodes_visited);
+        f("shortcut_hits", shortcut_hits);
+        f("shortcut_misses", shortcut_misses);
+        f("history_writes", history_writes);
+        f("scrub_passes", scrub_passes);
+        f("pool_transactions", pool_transactions);
+        f("keys", keys);
+        f("history_entries", history_entries);
+        f("max_history", max_history);
+        f("stale_shortcuts", stale_shortcuts);
+    }
+
+    double nodes_per_search() const {
+        return searches == 0 ? 0 : (double)nodes_visited / searches;
+    }
+
+    std::string to_string() const {
+        std::ostringstream out;
+        for_each([&](const char *name, long value) {
+            out << name << " = " << value << ", ";
+        });
+        out << "nodes_per_search = " << nodes_per_search();
+        return out.str();
+    }
+
+    std::string to_json() const {
+        std::ostringstream out;
+        out << "{";
+        for_each([&](const char *name, long value) {
+            out << "\"" << name << "\": " << value << ", ";
+        });
+        out << "\"nodes_per_search\": " << nodes_per_search() << "}";
+        return out.str();
+    }
+};
+
+#endif // __STATS
@@ -0,0 +1,24 @@
+#ifndef __SYNC_DIR
+#define __SYNC_DIR
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+// makes a rename over path durable: the new directory entry is only on disk once the parent directory is synced
+inline void sync_parent_dir(const std::string &path) {
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+	throw std::runtime_error("cannot open directory of " + path + ": " + strerror(errno));
+    int ret = fsync(fd);
+    close(fd);
+    if (ret != 0)
+	throw std::runtime_error("cannot sync directory of " + path + ": " + strerror(errno));
+}
+
+#endif // __SYNC_DIR
@@ -0,0 +1,14 @@
+#ifndef __VERSION_T
+#define __VERSION_T
+
+#include <cstdint>
+
+// Type of the versions (timestamps) used by vordered_kv_t and every history backend. 64-bit by
+// default so that they do not wrap; -D__VERSION_32 selects the 32-bit layout of older pools.
+#ifdef __VERSION_32
+typedef int32_t version_t;
+#else
+typedef int64_t version_t;
+#endif
+
+#endif // __VERSION_T
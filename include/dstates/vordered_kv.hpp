@@ -4,87 +4,381 @@
 #include "marker.hpp"
 #include "emem_history.hpp"
 #include "pmem_history.hpp"
+#include "mmap_history.hpp"
+#include "wal_history.hpp"
+#include "epoch.hpp"
+#include "arena.hpp"
+#include "write_batch.hpp"
+#include "stats.hpp"
+#include "snapshot_file.hpp"
 
+#include <omp.h>
+#include <new>
 #include <atomic>
 #include <functional>
+#include <tuple>
+#include <algorithm>
+#include <stdexcept>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 
 template <typename K, typename V, typename P = pmem_history_t <K, V>, bool use_shortcuts = true> class vordered_kv_t {
     static const int MAX_LEVEL = 24;
 
+    // the towers are laid out inline right after the node, one (next, shortcut) pair per level,
+    // so that the whole node is a single cache-line aligned allocation from the arena
     struct node_t {
         typedef std::atomic<node_t *> next_t;
+        struct link_t {
+            next_t next{nullptr}, shortcut{nullptr};
+        };
+        static const int CLAIMED = -1, UNLOGGED = -2;
 
         K key;
         typename P::plog_t history{nullptr};
-        std::vector<next_t> next, shortcut;
+        std::atomic<int> writers{0};
+        const int levels;
 
-        node_t(const K &k, int levels = MAX_LEVEL) : key(k), next(levels), shortcut(levels) { }
+        node_t(const K &k, int l) : key(k), levels(l) {
+            for (int i = 0; i < levels; i++)
+                new (&links()[i]) link_t();
+        }
+
+        static size_t size(int levels) {
+            return sizeof(node_t) + levels * sizeof(link_t);
+        }
+        link_t *links() {
+            return reinterpret_cast<link_t *>(this + 1);
+        }
+        next_t &next(int level) {
+            return links()[level].next;
+        }
+        next_t &shortcut(int level) {
+            return links()[level].shortcut;
+        }
+
+        // writers pin the node while updating its history, reclaim() claims it only when there are none.
+        // A node linked before pool.append() logged its key is UNLOGGED: writers wait for the key, since an
+        // update acknowledged before it would be lost by a crash in between, and reclaim() leaves it alone.
+        bool acquire() {
+            int w = writers.load();
+            do {
+                for (; w == UNLOGGED; w = writers.load())
+                    std::this_thread::yield();
+                if (w == CLAIMED)
+                    return false;
+            } while (!writers.compare_exchange_weak(w, w + 1));
+            return true;
+        }
+        void release() {
+            writers--;
+        }
+        bool claim() {
+            int w = 0;
+            return writers.compare_exchange_strong(w, CLAIMED);
+        }
+        bool claimed() {
+            return writers.load() == CLAIMED;
+        }
     };
 
-    node_t head, tail;
-    std::atomic<int> version{0};
+    // the low bit of a next pointer marks its owner as logically deleted at that level
+    static node_t *strip(node_t *ptr) {
+        return (node_t *)((uintptr_t)ptr & ~(uintptr_t)1);
+    }
+    static bool marked(node_t *ptr) {
+        return (uintptr_t)ptr & 1;
+    }
+
+    arena_t arena;
+    node_t *head, *tail;
+    // the version clock is either owned or shared with other stores, see sharded_kv_t
+    std::atomic<version_t> own_version{0};
+    std::atomic<version_t> &version;
     P pool;
-    unsigned int rand_state = 0x123;
-    std::mutex rand_mutex;
+    std::mutex reclaim_mutex;
+    std::shared_mutex tag_mutex;
+    bool persist_index;
+    counters_t<stats_t::COUNTERS> counters;
+    // incremental scrub cursor, scrub_curr is nullptr between passes. Guarded by reclaim_mutex and
+    // reset by reclaim(), which may free the nodes it points to.
+    int scrub_level = 0;
+    node_t *scrub_pred = nullptr, *scrub_curr = nullptr;
+    std::atomic<long> tombstones{0};
+    std::atomic<bool> maintaining{false};
+    std::thread maintainer;
+    std::atomic<bool> restored{false};
+    std::mutex restore_mutex;
+    std::condition_variable restore_cv;
+    std::thread restorer;
+
+    // links nodes arriving in ascending key order in one pass, without searching or CAS: each node
+    // is appended after the last node of every level it spans. Not thread-safe, the list must be private.
+    class builder_t {
+        vordered_kv_t &kv;
+        node_t *last[MAX_LEVEL];
+    public:
+        builder_t(vordered_kv_t &kv) : kv(kv) {
+            for (int i = 0; i < MAX_LEVEL; i++)
+                last[i] = kv.head;
+        }
+        node_t *append(const K &key, typename P::plog_t history, int levels = random_levels()) {
+            node_t *node = kv.new_node(key, levels);
+            node->history = history;
+            for (int i = 0; i < levels; i++) {
+                last[i]->next(i).store(node, std::memory_order_relaxed);
+                last[i] = node;
+            }
+            return node;
+        }
+        node_t *back() {
+            return last[0];
+        }
+        ~builder_t() {
+            for (int i = 0; i < MAX_LEVEL; i++)
+                last[i]->next(i).store(kv.tail);
+        }
+    };
+    epoch_t epoch;
+    // single writes against write_batch(), see block_writes()
+    epoch_t writes;
+    std::atomic<bool> batching{false};
+    std::mutex batch_mutex, gate_mutex;
+    std::condition_variable gate_cv;
+
+    node_t *new_node(const K &key, int levels) {
+        static_assert(alignof(node_t) <= 64 && sizeof(node_t) % alignof(typename node_t::link_t) == 0);
+        return new (arena.allocate(node_t::size(levels))) node_t(key, levels);
+    }
+
+    void delete_node(node_t *node) {
+        int levels = node->levels;
+        node->~node_t();
+        arena.deallocate(node, node_t::size(levels));
+    }
+
+    // geometric tower height (p = 1/2) from a per-thread xorshift generator, no shared state
+    static int random_levels() {
+        static thread_local unsigned int state = (0x123 ^ (unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return ffs(state | (1 << (MAX_LEVEL - 1)));
+    }
+
+    static bool dead(node_t *node, version_t watermark) {
+        return node->history->info.latest_removed() && node->history->info.latest_version() < watermark;
+    }
+
+    // marks every level of a claimed node, top down, so that no insert can link after it
+    void mark(node_t *node) {
+        for (int level = node->levels - 1; level >= 0; level--) {
+            node_t *succ = node->next(level).load();
+            while (!marked(succ) && !node->next(level).compare_exchange_weak(succ, (node_t *)((uintptr_t)succ | 1)));
+        }
+    }
+
+    // physically unlinks a marked node: a search without shortcuts snips it on every level
+    void unlink(node_t *node) {
+        node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+        find_node(node->key, preds, succs, false, false);
+    }
+
+    // drops shortcuts that point to claimed nodes
+    void clear_shortcuts() {
+        for (int level = 0; level < MAX_LEVEL; level++)
+            for (node_t *curr = head; curr != tail; curr = strip(curr->next(level).load())) {
+                node_t *scut = curr->shortcut(level).load();
+                if (scut != nullptr && scut->claimed())
+                    curr->shortcut(level).store(nullptr);
+            }
+    }
+
+    // rebuilds the index from the saved image if there is one, from the key chain otherwise
+    void restore() {
+	using namespace std::placeholders;
+	version_t v;
+	{
+	    builder_t builder(*this);
+	    if (!pool.load_index(std::bind(&builder_t::append, &builder, _1, _2, _3), v))
+		v = pool.restore([&](const K &key, typename P::plog_t history) {
+		    builder.append(key, history);
+		});
+	}
+	// a shared clock must not go back to an older version restored by this store
+	version_t prev = version.load();
+	while (prev < v && !version.compare_exchange_weak(prev, v));
+	std::unique_lock<std::mutex> lock(restore_mutex);
+	restored.store(true);
+	restore_cv.notify_all();
+	lock.unlock();
+	// finds that missed the flag may still be in pool.lookup()
+	epoch.synchronize();
+	pool.release_lookup();
+    }
+
+    // everything but find() waits for a lazy restore to complete before touching the index
+    void await_restore() {
+	if (restored.load())
+	    return;
+	std::unique_lock<std::mutex> lock(restore_mutex);
+	restore_cv.wait(lock, [&] { return restored.load(); });
+    }
 
 public:
     inline static const V low_marker = marker_t<V>::low_marker;
     inline static const V high_marker = marker_t<V>::high_marker;
 
-    vordered_kv_t(const std::string &db) : head(low_marker), tail(high_marker), pool(db) {
+    // with persist_index, a sorted image of the index is saved at clean shutdown. Whenever such an image
+    // exists, the next open rebuilds the skip list from it in one linear pass instead of re-inserting every key.
+    // With lazy_restore, the index is rebuilt by a background thread and the constructor returns right away:
+    // find() answers from the key chain meanwhile, all other operations wait for the index.
+    // With clock, versions are read from and tagged on that counter instead of a private one.
+    // pool_size is handed to the history backend, 0 keeps its default.
+    vordered_kv_t(const std::string &db, bool persist_index = false, bool lazy_restore = false,
+                  std::atomic<version_t> *clock = nullptr, size_t pool_size = 0) :
+        head(new_node(marker_t<K>::low_marker, MAX_LEVEL)), tail(new_node(marker_t<K>::high_marker, MAX_LEVEL)),
+        version(clock == nullptr ? own_version : *clock), pool(db, pool_size), persist_index(persist_index) {
         for (int i = 0; i < MAX_LEVEL; i++)
-            head.next[i].store(&tail);
-	using namespace std::placeholders;
-	version.store(pool.restore(std::bind(&vordered_kv_t::insert, this, _1, _2, _3)));
+            head->next(i).store(tail);
+	if (lazy_restore)
+	    restorer = std::thread(&vordered_kv_t::restore, this);
+	else
+	    restore();
     }
 
     ~vordered_kv_t() {
-        node_t *curr = head.next[0].load();
-        while (curr != &tail) {
-            node_t *next = curr->next[0].load();
+	if (restorer.joinable())
+	    restorer.join();
+	stop_maintainer();
+	if (persist_index)
+	    pool.save_index(version, [&](auto emit) {
+		for (node_t *curr = strip(head->next(0).load()); curr != tail; curr = strip(curr->next(0).load()))
+		    emit(curr->key, curr->history, curr->levels);
+	    });
+        node_t *curr = head->next(0).load();
+        while (curr != tail) {
+            node_t *next = strip(curr->next(0).load());
 	    pool.deallocate(curr->history, true);
-            delete curr;
+            delete_node(curr);
             curr = next;
         }
+        delete_node(head);
+        delete_node(tail);
     }
 
     void scrub() {
+        await_restore();
+        epoch_t::guard_t guard(epoch);
 	for (int level = 0; level < MAX_LEVEL; level++) {
-	    node_t *valid_pred = &head, *curr = valid_pred->next[level];
-	    while (curr != &tail) {
+	    node_t *valid_pred = head, *curr = valid_pred->next(level);
+	    while (curr != tail) {
 		bool curr_removed = curr->history->info.latest_removed();
 		if (!curr_removed) {
-		    valid_pred->shortcut[level].store(curr);
+		    valid_pred->shortcut(level).store(curr);
 		    valid_pred = curr;
 		}
-		curr = curr->next[level];
+		curr = strip(curr->next(level));
 	    }
+	    // nothing live follows, a shortcut left here could only lead to a tombstone
+	    valid_pred->shortcut(level).store(nullptr);
 	}
+	counters.add(stats_t::SCRUB_PASSES);
     }
 
-    node_t *find_node(const K &key, node_t **preds, node_t **succs, bool adjustment = false) {
-        int level = head.next.size() - 1;
-        node_t *pred = &head, *valid_pred = pred, *curr;
+    // resumable scrub(): repairs the shortcuts of at most budget nodes, then returns. A pass starts over at
+    // level 0 and walks the levels in turn, returns true once it has covered all of them.
+    bool scrub_step(size_t budget) {
+        await_restore();
+        std::unique_lock<std::mutex> lock(reclaim_mutex);
+        if (scrub_curr == nullptr) {
+            tombstones.store(0);
+            scrub_level = 0;
+            scrub_pred = head;
+            scrub_curr = strip(head->next(0).load());
+        }
+        for (; budget > 0; budget--) {
+            if (scrub_curr == tail) {
+                scrub_pred->shortcut(scrub_level).store(nullptr);
+                if (++scrub_level == MAX_LEVEL) {
+                    scrub_curr = nullptr;
+                    counters.add(stats_t::SCRUB_PASSES);
+                    return true;
+                }
+                scrub_pred = head;
+                scrub_curr = strip(head->next(scrub_level).load());
+                continue;
+            }
+            if (!scrub_curr->history->info.latest_removed()) {
+                scrub_pred->shortcut(scrub_level).store(scrub_curr);
+                scrub_pred = scrub_curr;
+            }
+            scrub_curr = strip(scrub_curr->next(scrub_level).load());
+        }
+        return false;
+    }
+
+    // starts a background thread that runs scrub passes in steps of budget nodes, whenever at least
+    // trigger keys were turned into tombstones since the last pass started
+    void start_maintainer(size_t budget = 4096, long trigger = 1024,
+                          std::chrono::milliseconds interval = std::chrono::milliseconds(10)) {
+        if (maintaining.exchange(true))
+            return;
+        maintainer = std::thread([this, budget, trigger, interval] {
+            bool pass = false;
+            while (maintaining.load()) {
+                if (pass || tombstones.load() >= trigger) {
+                    pass = !scrub_step(budget);
+                    std::this_thread::yield();
+                } else
+                    std::this_thread::sleep_for(interval);
+            }
+        });
+    }
+
+    void stop_maintainer() {
+        if (maintaining.exchange(false))
+            maintainer.join();
+    }
+
+private:
+    node_t *find_node(const K &key, node_t **preds, node_t **succs, bool adjustment = false, bool skip = true) {
+        long visited = 0, hits = 0, misses = 0;
+    retry:
+        int level = MAX_LEVEL - 1;
+        node_t *pred = head, *valid_pred = pred, *curr, *succ;
 	bool pred_removed = false;
 
         while (true) {
-	    curr = pred->next[level].load();
+	    curr = strip(pred->next(level).load());
+	    // help unlink nodes marked by reclaim(), restart if pred itself got marked
+	    while (marked(succ = curr->next(level).load())) {
+		if (!pred->next(level).compare_exchange_strong(curr, strip(succ)))
+		    goto retry;
+		curr = strip(succ);
+	    }
             if (curr->key < key) {
 		if constexpr(use_shortcuts) {
-		    node_t *scut = valid_pred->shortcut[level].load();
-		    if (scut != nullptr && scut->key > curr->key && scut->key < key)
+		    node_t *scut = skip ? valid_pred->shortcut(level).load() : nullptr;
+		    if (scut != nullptr && scut->key > curr->key && scut->key < key && !marked(scut->next(level).load())) {
 			curr = scut;
+			hits++;
+		    } else if (skip)
+			misses++;
 		    if (adjustment) {
 			bool curr_removed = curr->history->info.latest_removed();
 			if (!curr_removed) {
 			    if (pred_removed && curr != scut)
-				valid_pred->shortcut[level].store(curr);
+				valid_pred->shortcut(level).store(curr);
 			    valid_pred = curr;
 			}
 			pred_removed = curr_removed;
 		    }
 		}
                 pred = curr;
+		visited++;
 		continue;
 	    }
 	    preds[level] = pred;
@@ -93,53 +387,95 @@ public:
 		break;
 	    level--;
         }
+        counters.add(stats_t::SEARCHES);
+        counters.add(stats_t::NODES_VISITED, visited);
+        if constexpr(use_shortcuts) {
+            counters.add(stats_t::SHORTCUT_HITS, hits);
+            counters.add(stats_t::SHORTCUT_MISSES, misses);
+        }
         auto ret = curr->key == key ? curr : nullptr;
 	return ret;
     }
 
-    bool insert(const K &key, const V &value, typename P::plog_t plog = nullptr) {
+    // single writes run inside the writes epoch and hold off while block_writes() is in effect
+    template <typename F> bool gated(F &&f) {
+        while (true) {
+            {
+                epoch_t::guard_t guard(writes);
+                if (!batching.load())
+                    return f();
+            }
+            std::unique_lock<std::mutex> lock(gate_mutex);
+            gate_cv.wait(lock, [&] { return !batching.load(); });
+        }
+    }
+
+    bool insert_at(version_t v, const K &key, const V &value, typename P::plog_t plog) {
+        epoch_t::guard_t guard(epoch);
         node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
         node_t *pred, *succ, *node = nullptr;
-        while(true) {
+        for (bool first = true; ; first = false) {
+            if (!first)
+                counters.add(stats_t::INSERT_RETRIES);
             node_t *found = find_node(key, preds, succs);
             if (found) {
                 if (node) {
                     // somebody else was faster at inserting the same key
                     if (node->history != plog)
 			pool.deallocate(node->history);
-                    delete node;
+                    delete_node(node);
+                    node = nullptr;
                 }
-                node = found;
+                // claimed by reclaim(), retry until it is unlinked
+                if (!found->acquire())
+                    continue;
+                if (plog == nullptr) {
+                    found->history->insert(v, value);
+                    counters.add(stats_t::HISTORY_WRITES);
+                } else
+                    found->history = plog;
+                found->release();
+                return true;
             } else if (node == nullptr) {
-		std::unique_lock<std::mutex> lock(rand_mutex);
-		int rand_int = rand_r(&rand_state);
-		lock.unlock();
-                int levels = ffs(rand_int | (1 << (MAX_LEVEL - 1)));
-                node = new node_t(key, levels);
+                // the history is written once, a failed CAS below only relinks the node
+                node = new_node(key, random_levels());
+                if (plog == nullptr) {
+                    node->writers.store(node_t::UNLOGGED);
+                    node->history = pool.allocate();
+                    node->history->insert(v, value);
+                } else
+                    node->history = plog;
             }
-            if (plog == nullptr) {
-                if (node->history == nullptr)
-		    node->history = pool.allocate();
-                node->history->insert(version, value);
-            } else
-                node->history = plog;
             succ = succs[0];
-            if (succ == node)
-                return true;
-            for (size_t level = 0; level < node->next.size(); level++)
-                node->next[level].store(succs[level]);
+            for (int level = 0; level < node->levels; level++)
+                node->next(level).store(succs[level]);
             pred = preds[0];
-            if (pred->next[0].compare_exchange_weak(succ, node)) {
-                if (plog == nullptr)
-                    pool.append(key, node->history);
+            if (pred->next(0).compare_exchange_weak(succ, node)) {
+                // the key is logged and the write counted once the node won its place: logging it before would
+                // leave a second binding of the key behind whenever a concurrent insert of the same key wins instead
+                if (plog == nullptr) {
+                    counters.add(stats_t::HISTORY_WRITES);
+                    try {
+                        pool.append(key, node->history);
+                    } catch (...) {
+                        node->writers.store(0);
+                        throw;
+                    }
+                    node->writers.store(0);
+                }
                 break;
             }
         }
-        size_t level = 1;
-        while (level < node->next.size()) {
+        int level = 1;
+        while (level < node->levels) {
             pred = preds[level];
             succ = succs[level];
-            if (!pred->next[level].compare_exchange_weak(succ, node)) {
+            // stop linking if the node got marked in the meantime
+            node_t *old = node->next(level).load();
+            if (marked(old) || (old != succ && !node->next(level).compare_exchange_strong(old, succ)))
+                break;
+            if (!pred->next(level).compare_exchange_weak(succ, node)) {
+                counters.add(stats_t::INSERT_RETRIES);
                 find_node(key, preds, succs);
                 continue;
             }
@@ -148,16 +484,194 @@ public:
         return true;
     }
 
-    bool remove(const K &key) {
+    bool remove_at(version_t v, const K &key) {
+        epoch_t::guard_t guard(epoch);
         node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
-        node_t *node = find_node(key, preds, succs);
-        if (node == nullptr)
-            return false;
-        node->history->remove(version);
-        return true;
+        while (true) {
+            node_t *node = find_node(key, preds, succs);
+            if (node == nullptr)
+                return false;
+            if (!node->acquire())
+                continue;
+            if (!node->history->info.latest_removed())
+                tombstones++;
+            node->history->remove(v);
+            counters.add(stats_t::HISTORY_WRITES);
+            node->release();
+            return true;
+        }
     }
 
-    V find(int v, const K &key) {
+    // recomputes the info of a history from its entries, after an aborted batch rolled back some of them
+    static void reload_info(typename P::plog_t history) {
+        version_t t = -1;
+        bool removed = false;
+        history->for_each([&](version_t ts, const auto &val) {
+            t = ts;
+            removed = val == low_marker;
+        });
+        history->info.reset(t, removed);
+    }
+
+public:
+    // writes the sorted batch at version v, which readers do not see yet and single writes do not touch
+    // (see block_writes()). Nothing is published: the caller moves the clock to v afterwards. The histories
+    // and the key chain are written inside pool.batch(), the nodes of new keys are linked only once it
+    // committed. If it throws, the nodes are left as they were, the histories that were written get their
+    // info back from the entries that survived, and the exception propagates.
+    void stage_batch(const write_batch_t<K, V> &batch, version_t v) {
+        // reclaim() must not free a history whose update is still pending in pool.batch()
+        std::unique_lock<std::mutex> lock(reclaim_mutex);
+        epoch_t::guard_t guard(epoch);
+        std::vector<std::pair<K, typename P::plog_t>> created;
+        std::vector<typename P::plog_t> written;
+        long removed = 0;
+        node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+        try {
+            pool.batch([&] {
+                for (auto &op : batch) {
+                    bool remove = op.second == low_marker;
+                    counters.add(remove ? stats_t::REMOVES : stats_t::INSERTS);
+                    typename P::plog_t history = nullptr;
+                    if (!created.empty() && created.back().first == op.first)
+                        history = created.back().second;
+                    else if (node_t *node = find_node(op.first, preds, succs)) {
+                        history = node->history;
+                        written.push_back(history);
+                    } else if (remove)
+                        continue;
+                    else {
+                        history = pool.allocate();
+                        pool.append(op.first, history);
+                        created.emplace_back(op.first, history);
+                    }
+                    if (remove) {
+                        removed += !history->info.latest_removed();
+                        history->remove(v);
+                    } else
+                        history->insert(v, op.second);
+                    counters.add(stats_t::HISTORY_WRITES);
+                }
+            });
+        } catch (...) {
+            for (auto &c : created)
+                pool.deallocate(c.second, true);
+            for (auto history : written)
+                reload_info(history);
+            throw;
+        }
+        tombstones += removed;
+        for (auto &c : created)
+            insert_at(v, c.first, low_marker, c.second);
+    }
+
+    bool insert(const K &key, const V &value, typename P::plog_t plog = nullptr) {
+        await_restore();
+        counters.add(stats_t::INSERTS);
+        return gated([&] { return insert_at(version, key, value, plog); });
+    }
+
+    bool remove(const K &key) {
+        await_restore();
+        counters.add(stats_t::REMOVES);
+        return gated([&] { return remove_at(version, key); });
+    }
+
+    // unlinks and frees the nodes whose latest entry is a tombstone older than the watermark;
+    // versions below the watermark must not be queried afterwards. Not to be called from a visitor.
+    size_t reclaim(version_t watermark) {
+        await_restore();
+        std::unique_lock<std::mutex> lock(reclaim_mutex);
+        std::vector<node_t *> retired;
+        for (node_t *curr = strip(head->next(0).load()); curr != tail; curr = strip(curr->next(0).load())) {
+            if (!dead(curr, watermark) || !curr->claim())
+                continue;
+            // a writer may have slipped in between the check and the claim
+            if (!dead(curr, watermark)) {
+                curr->writers.store(0);
+                continue;
+            }
+            mark(curr);
+            retired.push_back(curr);
+        }
+        if (retired.empty())
+            return 0;
+        for (auto node : retired)
+            unlink(node);
+        // wait for inserts that could still link the retired nodes on upper levels, then unlink again
+        epoch.synchronize();
+        for (auto node : retired)
+            unlink(node);
+        clear_shortcuts();
+        epoch.synchronize();
+        std::vector<typename P::plog_t> logs;
+        for (auto node : retired) {
+            logs.push_back(node->history);
+            delete_node(node);
+        }
+        pool.reclaim(logs);
+        scrub_curr = nullptr;
+        return retired.size();
+    }
+
+    // drops the history entries no longer visible at any version >= watermark, returns how many were dropped.
+    // Every provider keeps the newest entry at or below the watermark and everything after it, a tombstone
+    // included, so a key reads the same at every version >= watermark before and after the call. Combine
+    // with reclaim(watermark) to also free the keys removed before the watermark.
+    size_t truncate_before(version_t watermark) {
+        await_restore();
+        std::unique_lock<std::mutex> lock(reclaim_mutex);
+        std::vector<node_t *> truncated;
+        size_t dropped = 0;
+        for (node_t *curr = strip(head->next(0).load()); curr != tail; curr = strip(curr->next(0).load())) {
+            size_t n = curr->history->truncate_before(watermark);
+            if (n > 0) {
+                dropped += n;
+                truncated.push_back(curr);
+            }
+        }
+        // memory dropped by lock-free histories is released after the readers are gone
+        epoch.synchronize();
+        for (auto node : truncated)
+            node->history->purge();
+        return dropped;
+    }
+
+    // builds the skip list from (key, value) pairs sorted by key in one linear pass, linking the towers
+    // directly instead of searching and CAS-ing every key. Equal keys go to the same history in input order,
+    // low_marker values are tombstones, so a sorted write_batch_t can be loaded as is. The store must be
+    // empty and not accessed concurrently. Returns the number of keys loaded.
+    template <typename I> size_t bulk_load(I begin, I end) {
+        return bulk_load(begin, end, version.load());
+    }
+
+    // same as bulk_load(begin, end), with the pairs written at version v instead of the current one
+    template <typename I> size_t bulk_load(I begin, I end, version_t v) {
+        await_restore();
+        if (strip(head->next(0).load()) != tail)
+            throw std::runtime_error("bulk_load requires an empty store");
+        builder_t builder(*this);
+        size_t count = 0;
+        for (I it = begin; it != end; ++it) {
+            node_t *node = builder.back();
+            if (node == head || node->key < it->first) {
+                node = builder.append(it->first, pool.allocate());
+                pool.append(it->first, node->history);
+                count++;
+            } else if (it->first < node->key)
+                throw std::runtime_error("bulk_load input is not sorted by key");
+            node->history->insert(v, it->second);
+        }
+        return count;
+    }
+
+    V find(version_t v, const K &key) {
+        counters.add(stats_t::FINDS);
+        epoch_t::guard_t guard(epoch);
+        if (!restored.load()) {
+            typename P::plog_t history = pool.lookup(key);
+            return history == nullptr ? low_marker : history->find(v);
+        }
 	node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
         node_t *node = find_node(key, preds, succs, false);
         if (node == nullptr)
@@ -166,39 +680,280 @@ public:
             return node->history->find(v);
     }
 
-    void get_snapshot(int v, std::vector<std::pair<K, V>> &result) {
-        result.clear();
-        node_t *curr = head.next[0].load();
-        while (curr != &tail) {
-            auto p = std::make_pair(curr->key, curr->history->find(v));
-            if (p.second != low_marker)
-                result.push_back(p);
-            curr = curr->next[0].load();
+private:
+    // visits the level 0 nodes in [begin, end), keys are compared since end may get unlinked meanwhile
+    template <typename F> void visit_segment(version_t v, node_t *begin, node_t *end, F &&f) {
+        for (node_t *curr = begin; curr != tail && (end == tail || curr->key < end->key); curr = strip(curr->next(0).load()))
+            curr->history->visit(v, [&](const auto &val) {
+                f(curr->key, val);
+            });
+    }
+
+    // splits level 0 into at most n segments, delimited by the towers of the highest level with enough nodes
+    std::vector<node_t *> partition(int n) {
+        std::vector<node_t *> towers, bounds{strip(head->next(0).load())};
+        for (int level = MAX_LEVEL - 1; level > 0; level--) {
+            towers.clear();
+            for (node_t *curr = strip(head->next(level).load()); curr != tail; curr = strip(curr->next(level).load()))
+                towers.push_back(curr);
+            if (towers.size() >= (size_t)n)
+                break;
         }
+        if (towers.size() >= (size_t)n)
+            for (int i = 1; i < n; i++)
+                bounds.push_back(towers[i * towers.size() / n]);
+        bounds.push_back(tail);
+        return bounds;
     }
 
-    void get_key_history(const K &key, std::vector<std::pair<int, V>> &result) {
-        result.clear();
+public:
+
+    // streams (key, value) pairs visible at version v in key order, values are passed as views
+    template <typename F> void visit_snapshot(version_t v, F &&f) {
+        await_restore();
+        counters.add(stats_t::SCANS);
+        epoch_t::guard_t guard(epoch);
+        visit_segment(v, head->next(0).load(), tail, f);
+    }
+
+    // same as visit_snapshot, restricted to keys in [lo, hi): seek to lo, then walk level 0 only
+    template <typename F> void visit_range(version_t v, const K &lo, const K &hi, F &&f) {
+        await_restore();
+        counters.add(stats_t::SCANS);
+        epoch_t::guard_t guard(epoch);
+	node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+        find_node(lo, preds, succs, false);
+        node_t *curr = succs[0];
+        while (curr != tail && curr->key < hi) {
+            curr->history->visit(v, [&](const auto &val) {
+                f(curr->key, val);
+            });
+            curr = strip(curr->next(0).load());
+        }
+    }
+
+    // streams the (version, value) history of key in place, without copying the log
+    template <typename F> void visit_key_history(const K &key, F &&f) {
+        await_restore();
+        epoch_t::guard_t guard(epoch);
 	node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
         node_t *node = find_node(key, preds, succs, false);
-        if (node == nullptr)
+        if (node != nullptr)
+            node->history->for_each(f);
+    }
+
+    // same as visit_key_history, restricted to the versions in [from, to]
+    template <typename F> void visit_key_history(const K &key, version_t from, version_t to, F &&f) {
+        await_restore();
+        epoch_t::guard_t guard(epoch);
+	node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+        node_t *node = find_node(key, preds, succs, false);
+        if (node != nullptr)
+            node->history->for_each(from, to, f);
+    }
+
+    // streams (key, value at v1, value at v2) in key order for the keys whose visible value differs between
+    // the two versions, low_marker standing for no value. Keys not updated since min(v1, v2) are skipped
+    // by their key_info_t alone, without searching their history.
+    template <typename F> void visit_changes(version_t v1, version_t v2, F &&f) {
+        await_restore();
+        counters.add(stats_t::SCANS);
+        epoch_t::guard_t guard(epoch);
+        version_t since = std::min(v1, v2);
+        for (node_t *curr = strip(head->next(0).load()); curr != tail; curr = strip(curr->next(0).load())) {
+            if (curr->history->info.latest_version() <= since)
+                continue;
+            V before = curr->history->find(v1), after = curr->history->find(v2);
+            if (before != after)
+                f(curr->key, before, after);
+        }
+    }
+
+    // with threads > 1, each thread extracts one segment of the key space and the segments are concatenated in order
+    void get_snapshot(version_t v, std::vector<std::pair<K, V>> &result, int threads = 1) {
+        await_restore();
+        result.clear();
+        if (threads <= 1) {
+            visit_snapshot(v, [&](const K &key, const auto &val) {
+                result.emplace_back(key, val);
+            });
             return;
-        node->history->copy_to(result);
+        }
+        counters.add(stats_t::SCANS);
+        epoch_t::guard_t guard(epoch);
+        std::vector<node_t *> bounds = partition(threads);
+        int segments = bounds.size() - 1;
+        std::vector<std::vector<std::pair<K, V>>> parts(segments);
+        #pragma omp parallel for num_threads(segments) schedule(static, 1)
+        for (int i = 0; i < segments; i++)
+            visit_segment(v, bounds[i], bounds[i + 1], [&](const K &key, const auto &val) {
+                parts[i].emplace_back(key, val);
+            });
+        size_t total = 0;
+        for (auto &part : parts)
+            total += part.size();
+        result.reserve(total);
+        for (auto &part : parts)
+            std::move(part.begin(), part.end(), std::back_inserter(result));
+    }
+
+    void get_range(version_t v, const K &lo, const K &hi, std::vector<std::pair<K, V>> &result) {
+        result.clear();
+        visit_range(v, lo, hi, [&](const K &key, const auto &val) {
+            result.emplace_back(key, val);
+        });
+    }
+
+    // T is version_t, or any type the caller wants the versions converted to
+    template <typename T> void get_key_history(const K &key, std::vector<std::pair<T, V>> &result) {
+        result.clear();
+        visit_key_history(key, [&](version_t ts, const auto &val) {
+            result.emplace_back(ts, val);
+        });
+    }
+
+    // the history entries of key with versions in [from, to], found by binary search instead of copying the log
+    template <typename T> void get_key_history(const K &key, version_t from, version_t to, std::vector<std::pair<T, V>> &result) {
+        result.clear();
+        visit_key_history(key, from, to, [&](version_t ts, const auto &val) {
+            result.emplace_back(ts, val);
+        });
     }
 
-    int latest() {
+    void get_changes(version_t v1, version_t v2, std::vector<std::tuple<K, V, V>> &result) {
+        result.clear();
+        visit_changes(v1, v2, [&](const K &key, const V &before, const V &after) {
+            result.emplace_back(key, before, after);
+        });
+    }
+
+    // writes the snapshot at version v to path as a snapshot_file_t, returns the number of keys
+    size_t export_snapshot(version_t v, const std::string &path, bool bloom = true) {
+        snapshot_writer_t<K, V> writer(path, bloom);
+        visit_snapshot(v, [&](const K &key, const auto &val) {
+            writer.append(key, val);
+        });
+        return writer.finish(v);
+    }
+
+    // loads a snapshot file written by export_snapshot() into an empty store at the version of the snapshot,
+    // see bulk_load(), then moves the clock past it: a replica answers find(file.version(), key) like the source
+    size_t import_snapshot(const std::string &path) {
+        snapshot_file_t<K, V> file(path);
+        size_t count = bulk_load(file.begin(), file.end(), file.version());
+        version_t prev = version.load(), next = file.version() + 1;
+        while (prev < next && !version.compare_exchange_weak(prev, next));
+        pool.tag(version.load());
+        return count;
+    }
+
+    version_t latest() {
+        await_restore();
         return version;
     }
 
-    int tag() {
-        return version++;
+    version_t tag() {
+        await_restore();
+        std::unique_lock<std::shared_mutex> lock(tag_mutex);
+        version_t v = version++;
+        pool.tag(v + 1);
+        return v;
+    }
+
+    // records a clock value tagged on behalf of this store by the owner of a shared clock
+    void pool_tag(version_t clock) {
+        await_restore();
+        pool.tag(clock);
+    }
+
+    // holds single writes off until allow_writes(), waiting for the ones in flight, so that a batch can
+    // be staged at the next version before the clock moves there. Used by sharded_kv_t for its shards.
+    void block_writes() {
+        await_restore();
+        batch_mutex.lock();
+        batching.store(true);
+        writes.synchronize();
+    }
+    void allow_writes() {
+        {
+            std::unique_lock<std::mutex> lock(gate_mutex);
+            batching.store(false);
+        }
+        gate_cv.notify_all();
+        batch_mutex.unlock();
+    }
+
+    // applies all updates of the batch at the version after the current one, then moves the clock there
+    // and returns it: readers see the whole batch or none of it. If pool.batch() fails, nothing is applied
+    // and the clock stays. Single writes and tag() wait meanwhile. The batch is left as it is; a sorted
+    // copy is applied, so that concurrent batches visit the keys in the same order.
+    version_t write_batch(const write_batch_t<K, V> &batch) {
+        write_batch_t<K, V> sorted = batch;
+        sorted.sort();
+        await_restore();
+        std::unique_lock<std::shared_mutex> lock(tag_mutex);
+        block_writes();
+        version_t v = version + 1;
+        try {
+            stage_batch(sorted, v);
+            version.store(v);
+            // a batch that wrote no entry leaves nothing at v for a restart to resume the clock from
+            pool.tag(v);
+        } catch (...) {
+            allow_writes();
+            throw;
+        }
+        allow_writes();
+        return v;
     }
 
     void clear_stats() {
+        counters.clear();
+        pool.clear_transactions();
+    }
+
+    // counters since the last clear_stats(), read in O(1). With walk, the key count and history lengths
+    // are measured too, by walking level 0, and the stale shortcuts by walking every level; they stay 0 otherwise.
+    stats_t stats(bool walk = false) {
+        stats_t s;
+        s.inserts = counters.get(stats_t::INSERTS);
+        s.removes = counters.get(stats_t::REMOVES);
+        s.finds = counters.get(stats_t::FINDS);
+        s.scans = counters.get(stats_t::SCANS);
+        s.insert_retries = counters.get(stats_t::INSERT_RETRIES);
+        s.searches = counters.get(stats_t::SEARCHES);
+        s.nodes_visited = counters.get(stats_t::NODES_VISITED);
+        s.shortcut_hits = counters.get(stats_t::SHORTCUT_HITS);
+        s.shortcut_misses = counters.get(stats_t::SHORTCUT_MISSES);
+        s.history_writes = counters.get(stats_t::HISTORY_WRITES);
+        s.scrub_passes = counters.get(stats_t::SCRUB_PASSES);
+        s.pool_transactions = pool.transactions();
+        if (!walk)
+            return s;
+        await_restore();
+        epoch_t::guard_t guard(epoch);
+        for (node_t *curr = strip(head->next(0).load()); curr != tail; curr = strip(curr->next(0).load())) {
+            long length = curr->history->size();
+            s.keys++;
+            s.history_entries += length;
+            s.max_history = std::max(s.max_history, length);
+        }
+        // shortcuts that lookups still follow, out of live nodes, but that lead to a tombstone
+        if constexpr(use_shortcuts)
+            for (int level = 0; level < MAX_LEVEL; level++)
+                for (node_t *curr = head; curr != tail; curr = strip(curr->next(level).load())) {
+                    if (curr != head && curr->history->info.latest_removed())
+                        continue;
+                    node_t *scut = curr->shortcut(level).load();
+                    if (scut != nullptr && scut != tail && scut->history->info.latest_removed())
+                        s.stale_shortcuts++;
+                }
+        return s;
     }
 
-    const std::string get_stats() {
-        return "not yet implemented";
+    const std::string get_stats(bool json = false, bool walk = false) {
+        stats_t s = stats(walk);
+        return json ? s.to_json() : s.to_string();
     }
 };
 
@@ -0,0 +1,195 @@
+#ifndef __WAL
+#define __WAL
+
+#include "serializer.hpp"
+#include "sync_dir.hpp"
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <functional>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Append-only write-ahead log of checksummed records. append() returns once its record is durable:
+// records appended while a flush is in progress are collected and written by the next flusher with
+// a single write and fdatasync (group commit), so concurrent writers share the cost of the sync.
+class wal_t {
+    struct frame_t {
+	uint32_t length, checksum;
+    };
+
+    static constexpr size_t CHUNK = 1 << 20; // replay() and rewrite() hold at most one chunk and one record
+
+    std::string path;
+    int fd = -1;
+    std::mutex mutex;
+    std::condition_variable flushed;
+    std::vector<char> pending;     // records of the group being collected
+    uint64_t next = 1, durable = 0; // group collecting records, last group synced
+    bool flushing = false, failed = false; // after a failed flush, the log refuses further appends
+    long syncs = 0;
+
+    static void write_to(int out, const std::vector<char> &buf) {
+	for (size_t done = 0; done < buf.size(); ) {
+	    ssize_t n = ::write(out, buf.data() + done, buf.size() - done);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n < 0)
+		throw std::runtime_error("cannot write WAL: " + std::string(strerror(errno)));
+	    done += n;
+	}
+    }
+
+    void write_all(const std::vector<char> &buf) {
+	write_to(fd, buf);
+	if (fdatasync(fd) != 0)
+	    throw std::runtime_error("cannot sync WAL: " + std::string(strerror(errno)));
+    }
+
+public:
+    wal_t(const std::string &path) : path(path) {
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+	    throw std::runtime_error("cannot open WAL " + path + ": " + strerror(errno));
+    }
+    wal_t(const wal_t &) = delete;
+    ~wal_t() {
+	close(fd);
+    }
+
+    // calls f(payload, size) for every valid record in order, then cuts off a torn tail so that
+    // new records follow the last valid one. The file is read in chunks. Returns the number of bytes kept.
+    size_t replay(std::function<void (const char *, size_t)> f) {
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	    throw std::runtime_error("cannot stat WAL: " + std::string(strerror(errno)));
+	size_t size = st.st_size, pos = 0, begin = 0; // buf holds the bytes [begin, begin + buf.size()) of the file
+	std::vector<char> buf;
+	// makes buf hold the need bytes from pos on, false if the file ends before
+	auto fill = [&](size_t need) {
+	    if (pos + need > size)
+		return false;
+	    if (pos + need <= begin + buf.size())
+		return true;
+	    buf.erase(buf.begin(), buf.begin() + (pos - begin));
+	    begin = pos;
+	    size_t done = buf.size();
+	    buf.resize(std::min(std::max(need, CHUNK), size - begin));
+	    while (done < buf.size()) {
+		ssize_t n = pread(fd, buf.data() + done, buf.size() - done, begin + done);
+		if (n < 0 && errno == EINTR)
+		    continue;
+		if (n <= 0)
+		    throw std::runtime_error("cannot read WAL: " + std::string(strerror(errno)));
+		done += n;
+	    }
+	    return true;
+	};
+	while (fill(sizeof(frame_t))) {
+	    frame_t frame;
+	    deserialize(buf.data() + pos - begin, frame);
+	    if (!fill(sizeof(frame_t) + frame.length))
+		break;
+	    const char *payload = buf.data() + pos - begin + sizeof(frame_t);
+	    if (frame.checksum != checksum(payload, frame.length))
+		break;
+	    f(payload, frame.length);
+	    pos += sizeof(frame_t) + frame.length;
+	}
+	if (pos < size && (ftruncate(fd, pos) != 0 || fdatasync(fd) != 0))
+	    throw std::runtime_error("cannot truncate WAL: " + std::string(strerror(errno)));
+	return pos;
+    }
+
+    // checkpoint: replaces the log by the records that fill(emit) passes to emit, written under a temporary
+    // name and renamed over the log, so that a crash leaves either log complete. The rename is made durable by
+    // syncing the parent directory. Appends must not run meanwhile.
+    // Returns the size of the new log.
+    size_t rewrite(std::function<void (std::function<void (const std::vector<char> &)>)> fill) {
+	std::string tmp = path + ".checkpoint";
+	int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (out < 0)
+	    throw std::runtime_error("cannot create WAL checkpoint " + tmp + ": " + strerror(errno));
+	std::vector<char> buf;
+	size_t size = 0;
+	try {
+	    fill([&](const std::vector<char> &payload) {
+		serialize(buf, frame_t{(uint32_t)payload.size(), checksum(payload.data(), payload.size())});
+		buf.insert(buf.end(), payload.begin(), payload.end());
+		if (buf.size() >= CHUNK) {
+		    write_to(out, buf);
+		    size += buf.size();
+		    buf.clear();
+		}
+	    });
+	    write_to(out, buf);
+	    size += buf.size();
+	    if (fdatasync(out) != 0 || std::rename(tmp.c_str(), path.c_str()) != 0)
+		throw std::runtime_error("cannot replace WAL " + path + ": " + strerror(errno));
+	} catch (...) {
+	    close(out);
+	    std::remove(tmp.c_str());
+	    throw;
+	}
+	close(fd);
+	fd = out;
+	sync_parent_dir(path);
+	return size;
+    }
+
+    void append(const std::vector<char> &payload) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (failed)
+	    throw std::runtime_error("WAL failed earlier, no more appends");
+	serialize(pending, frame_t{(uint32_t)payload.size(), checksum(payload.data(), payload.size())});
+	pending.insert(pending.end(), payload.begin(), payload.end());
+	uint64_t group = next;
+	while (durable < group) {
+	    if (failed)
+		throw std::runtime_error("WAL failed before the record was synced");
+	    if (flushing) {
+		flushed.wait(lock);
+		continue;
+	    }
+	    // becomes the flusher of everything collected so far, including the records of the waiters
+	    flushing = true;
+	    std::vector<char> buf;
+	    buf.swap(pending);
+	    uint64_t last = next++;
+	    lock.unlock();
+	    try {
+		write_all(buf);
+	    } catch (...) {
+		lock.lock();
+		flushing = false;
+		failed = true;
+		flushed.notify_all();
+		throw;
+	    }
+	    lock.lock();
+	    flushing = false;
+	    durable = last;
+	    syncs++;
+	    flushed.notify_all();
+	}
+    }
+
+    long get_syncs() {
+	std::unique_lock<std::mutex> lock(mutex);
+	return syncs;
+    }
+    void clear_syncs() {
+	std::unique_lock<std::mutex> lock(mutex);
+	syncs = 0;
+    }
+};
+
+#endif // __WAL
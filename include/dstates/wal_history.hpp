@@ -0,0 +1,49 @@
+#ifndef __WAL_HISTORY
+#define __WAL_HISTORY
+
+#include "history_log.hpp"
+#include "wal.hpp"
+
+#include <string>
+
+#include "debug.hpp"
+
+// The ephemeral engine made durable: histories are the in-memory ekey_history_t of emem_history_t,
+// and every update and tag is written to a write-ahead log at db before it returns. Concurrent
+// writers are group committed, a restart replays the log sequentially into the skip list. When most of
+// the replayed records are dead, the log is checkpointed right after: rewritten with the live records only.
+template <typename K, typename V> class wal_history_t : public history_log_t<K, V> {
+    wal_t wal;
+
+protected:
+    void commit(const std::vector<char> &payload) override {
+	wal.append(payload);
+    }
+
+public:
+    wal_history_t(const std::string &db, size_t pool_size = 0) : wal(db) {
+	TIMER_START(replay);
+	size_t bytes = wal.replay([&](const char *payload, size_t size) {
+	    this->replay(payload, size);
+	});
+	this->recover();
+	TIMER_STOP(replay, "replayed WAL " << db << ", bytes = " << bytes);
+	if (this->worth_compacting()) {
+	    TIMER_START(checkpoint);
+	    bytes = wal.rewrite([&](auto emit) {
+		this->compact(emit);
+	    });
+	    TIMER_STOP(checkpoint, "checkpointed WAL " << db << ", bytes = " << bytes);
+	}
+    }
+
+    // number of fdatasync calls, each one commits a group of records
+    long transactions() {
+	return wal.get_syncs();
+    }
+    void clear_transactions() {
+	wal.clear_syncs();
+    }
+};
+
+#endif // __WAL_HISTORY
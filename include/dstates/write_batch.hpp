@@ -0,0 +1,43 @@
+#ifndef __WRITE_BATCH
+#define __WRITE_BATCH
+
+#include "marker.hpp"
+
+#include <vector>
+#include <algorithm>
+
+// A group of updates applied by vordered_kv_t::write_batch at a single version.
+// Removals are stored as tombstones (low marker), the same way the histories record them.
+template <typename K, typename V> class write_batch_t {
+    std::vector<std::pair<K, V>> ops;
+
+public:
+    typedef typename std::vector<std::pair<K, V>>::const_iterator const_iterator;
+
+    void insert(const K &key, const V &value) {
+        ops.emplace_back(key, value);
+    }
+    void remove(const K &key) {
+        ops.emplace_back(key, marker_t<V>::low_marker);
+    }
+    // orders the updates by key, keeping the order of updates to the same key
+    void sort() {
+        std::stable_sort(ops.begin(), ops.end(), [](const auto &a, const auto &b) {
+            return a.first < b.first;
+        });
+    }
+    void clear() {
+        ops.clear();
+    }
+    size_t size() const {
+        return ops.size();
+    }
+    const_iterator begin() const {
+        return ops.begin();
+    }
+    const_iterator end() const {
+        return ops.end();
+    }
+};
+
+#endif // __WRITE_BATCH
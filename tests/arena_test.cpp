@@ -0,0 +1,63 @@
+#include "dstates/arena.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <set>
+
+static const int N = 10000, THREADS = 8;
+
+int main() {
+    arena_t arena;
+
+    // blocks freed by another thread, as reclaim() does from the maintainer, return to the allocating thread
+    std::vector<void *> blocks(N);
+    for (int i = 0; i < N; i++)
+        blocks[i] = arena.allocate(3 * 64);
+    std::set<void *> freed(blocks.begin(), blocks.end());
+    std::thread([&] {
+        for (auto block : blocks)
+            arena.deallocate(block, 3 * 64);
+    }).join();
+    for (int i = 0; i < N; i++)
+        assert(freed.count(arena.allocate(3 * 64)) == 1);
+    std::cout << "checked " << N << " blocks freed by another thread are reused by the allocating one" << std::endl;
+
+    // every thread frees the blocks of its neighbour while allocating its own, live blocks never overlap
+    std::vector<std::vector<char *>> owned(THREADS);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++)
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < N; i++) {
+                size_t size = 64 * (1 + i % 7);
+                char *block = (char *)arena.allocate(size);
+                std::memset(block, t, size);
+                owned[t].push_back(block);
+            }
+        });
+    for (auto &thread : threads)
+        thread.join();
+    threads.clear();
+    for (int t = 0; t < THREADS; t++)
+        threads.emplace_back([&, t] {
+            std::vector<char *> &other = owned[(t + 1) % THREADS];
+            for (int i = 0; i < N; i++) {
+                size_t size = 64 * (1 + i % 7);
+                assert(other[i][0] == (t + 1) % THREADS && other[i][size - 1] == (t + 1) % THREADS);
+                arena.deallocate(other[i], size);
+                char *block = (char *)arena.allocate(size);
+                std::memset(block, 0x40 + t, size);
+                other[i] = block;
+            }
+        });
+    for (auto &thread : threads)
+        thread.join();
+    for (int t = 0; t < THREADS; t++)
+        for (int i = 0; i < N; i++)
+            assert(owned[t][i][0] == 0x40 + (t + THREADS - 1) % THREADS);
+    std::cout << "checked " << THREADS << " threads freeing each other's blocks while allocating" << std::endl;
+
+    return 0;
+}
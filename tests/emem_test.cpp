@@ -0,0 +1,9 @@
+#include "scenario.hpp"
+
+int main() {
+    run_scenario<emem_history_t<int, int>>("/dev/shm/test.db");
+    run_scenario<mmap_history_t<int, int>>("/dev/shm/test.db");
+    run_scenario<wal_history_t<int, int>>("/dev/shm/test.db");
+    std::filesystem::remove_all("/dev/shm/test.db");
+    return 0;
+}
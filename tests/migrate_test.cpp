@@ -0,0 +1,123 @@
+#include "dstates/vordered_kv.hpp"
+#include "dstates/marker.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <filesystem>
+
+// built once with version_t as configured and once with -D__VERSION_32, so that both migration paths run
+
+static const int marker = marker_t<int>::low_marker;
+static const int N = 1500; // spans two key chain blocks
+static const size_t BLOCK_SIZE = 1024;
+
+// the layout of a pool written before version_size existed: 32-bit versions, a key chain without a
+// block directory and the {int version; bool removed} info word of every history
+struct legacy_history_t {
+    pmem::obj::vector<std::pair<int32_t, int>> log;
+    pmem::obj::shared_mutex tx_mutex;
+    int version = 0;
+    bool removed = false;
+
+    void append(int32_t ts, int val) {
+        log.emplace_back(ts, val);
+    }
+};
+// the popt_history_t of such a pool: one array of entries, before the structure-of-arrays layout
+struct legacy_popt_history_t {
+    struct entry_t {
+        int32_t ts;
+        int val;
+        bool marked;
+    };
+    pmem::obj::array<entry_t, 16> history;
+    pmem::obj::p<int> tail, pending;
+    pmem::obj::pool_base pool;
+    pmem::obj::mutex tx_mutex;
+    int version = 0;
+    bool removed = false;
+
+    void append(int32_t ts, int val) {
+        history[pending] = {ts, val, true};
+        pending = pending + 1;
+        tail = pending;
+    }
+};
+template <class H> struct legacy_link_t {
+    typedef std::pair<int, pmem::obj::persistent_ptr<H>> entry_t;
+    pmem::obj::array<entry_t, BLOCK_SIZE> block;
+    pmem::obj::persistent_ptr<legacy_link_t> next = nullptr;
+};
+template <class H> struct legacy_chain_t {
+    pmem::obj::persistent_ptr<legacy_link_t<H>> head, tail;
+    pmem::obj::p<size_t> no_blocks;
+    pmem::obj::mutex tx_mutex;
+    pmem::obj::pool_base pool;
+    size_t pending;
+};
+template <class H> struct legacy_root_t {
+    pmem::obj::persistent_ptr<legacy_chain_t<H>> keymap;
+};
+
+// key i is live at version 1, then live at version 5 if it is odd and removed at version 5 otherwise
+template <class H> void create_legacy_pool(const std::string &db) {
+    typedef legacy_link_t<H> link_t;
+    auto pool = pmem::obj::pool<legacy_root_t<H>>::create(db, "vordered_map_pool", 64 << 20);
+    pmem::obj::transaction::run(pool, [&] {
+        auto chain = pmem::obj::make_persistent<legacy_chain_t<H>>();
+        chain->head = chain->tail = pmem::obj::make_persistent<link_t>();
+        chain->no_blocks = 1;
+        for (int i = 0; i < N; i++) {
+            if (i > 0 && i % BLOCK_SIZE == 0) {
+                chain->tail->next = pmem::obj::make_persistent<link_t>();
+                chain->tail = chain->tail->next;
+                chain->no_blocks = chain->no_blocks + 1;
+            }
+            auto history = pmem::obj::make_persistent<H>();
+            history->append(1, i);
+            history->append(5, i % 2 == 0 ? marker : i + 1);
+            history->version = 5;
+            history->removed = i % 2 == 0;
+            chain->tail->block[i % BLOCK_SIZE] = typename link_t::entry_t(i, history);
+        }
+        chain->pending = N % BLOCK_SIZE;
+        pool.root()->keymap = chain;
+    });
+    pool.close();
+}
+
+template <class KV> void check_content(KV &vordered_kv) {
+    assert(vordered_kv.latest() == 5);
+    for (int i = 0; i < N; i++) {
+        assert(vordered_kv.find(1, i) == i);
+        assert(vordered_kv.find(5, i) == (i % 2 == 0 ? marker : i + 1));
+    }
+}
+
+template <class KV, class H> void run_migration(const std::string &db, const std::string &name) {
+    std::filesystem::remove_all(db);
+    create_legacy_pool<H>(db);
+    {
+        KV vordered_kv(db);
+        check_content(vordered_kv);
+        std::cout << "migrated " << N << " " << name << " keys to " << 8 * sizeof(version_t) << "-bit versions" << std::endl;
+    }
+    {
+        KV vordered_kv(db);
+        check_content(vordered_kv);
+        // only the keys removed at version 5 are dead, live ones must not be mistaken for tombstones
+        assert(vordered_kv.reclaim(6) == N / 2);
+        for (int i = 1; i < N; i += 2)
+            assert(vordered_kv.find(6, i) == i + 1);
+        std::cout << "checked latest version, content and reclaim after reopening the migrated " << name << " pool" << std::endl;
+    }
+    std::filesystem::remove_all(db);
+}
+
+int main() {
+    std::string db = "/dev/shm/migrate_test.db";
+
+    run_migration<vordered_kv_t<int, int>, legacy_history_t>(db, "pkey");
+    run_migration<vordered_kv_t<int, int, pmem_history_t<int, int, popt_history_t<int>>>, legacy_popt_history_t>(db, "popt");
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "dstates/vordered_kv.hpp"
+#include "dstates/marker.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+
+using mmap_vordered_kv_t = vordered_kv_t<std::string, std::string, mmap_history_t<std::string, std::string>>;
+
+static const std::string marker = marker_t<std::string>::low_marker;
+static const int N = 5000;
+
+static std::string key(int i) {
+    return "key" + std::to_string(i);
+}
+
+void check_content(mmap_vordered_kv_t &vordered_kv) {
+    for (int i = 0; i < N; i++) {
+        assert(vordered_kv.find(0, key(i)) == "val" + std::to_string(i));
+        assert(vordered_kv.find(1, key(i)) == (i % 2 == 0 ? marker : "val" + std::to_string(i)));
+        assert(vordered_kv.find(2, key(i)) == vordered_kv.find(1, key(i)));
+        assert(vordered_kv.find(3, key(i)) == (i % 10 == 1 ? "new" + std::to_string(i) : vordered_kv.find(1, key(i))));
+    }
+    std::vector<std::pair<std::string, std::string>> result;
+    vordered_kv.get_snapshot(1, result);
+    assert(result.size() == N / 2);
+    for (size_t i = 1; i < result.size(); i++)
+        assert(result[i - 1].first < result[i].first);
+}
+
+int main() {
+    std::string db = "/dev/shm/mmap_test.db";
+    std::filesystem::remove_all(db);
+
+    {
+        // starts small, so that the file has to grow several times
+        mmap_vordered_kv_t vordered_kv(db, false, false, nullptr, 1 << 16);
+        for (int i = 0; i < N; i++)
+            vordered_kv.insert(key(i), "val" + std::to_string(i));
+        vordered_kv.tag();
+        for (int i = 0; i < N; i += 2)
+            vordered_kv.remove(key(i));
+        vordered_kv.tag();
+        write_batch_t<std::string, std::string> batch;
+        for (int i = 1; i < N; i += 10)
+            batch.insert(key(i), "new" + std::to_string(i));
+        assert(vordered_kv.write_batch(batch) == 3);
+        check_content(vordered_kv);
+        std::cout << "inserted " << N << " keys, removed every second one and updated every tenth one in a batch" << std::endl;
+    }
+    {
+        mmap_vordered_kv_t vordered_kv(db);
+        assert(vordered_kv.latest() == 3); // the clock after the last tag
+        check_content(vordered_kv);
+        std::cout << "checked content after replaying the history file" << std::endl;
+    }
+    {
+        mmap_vordered_kv_t vordered_kv(db, false, true);
+        for (int i = 1; i < N; i += 500)
+            assert(vordered_kv.find(1, key(i)) == "val" + std::to_string(i));
+        check_content(vordered_kv);
+        // removed keys are gone for good once reclaimed, also after the next restart
+        assert(vordered_kv.reclaim(3) == N / 2);
+        vordered_kv.insert(key(0), "again");
+        std::cout << "checked content with lazy restore, reclaimed the removed keys" << std::endl;
+    }
+    size_t before = std::filesystem::file_size(db);
+    {
+        mmap_vordered_kv_t vordered_kv(db);
+        std::vector<std::pair<std::string, std::string>> result;
+        vordered_kv.get_snapshot(vordered_kv.latest(), result);
+        assert(result.size() == N / 2 + 1 && result[0] == std::make_pair(key(0), std::string("again")));
+        std::cout << "checked reclaimed keys stay reclaimed after replaying" << std::endl;
+    }
+    {
+        // the open above found the file mostly made of reclaimed keys and compacted it
+        mmap_vordered_kv_t vordered_kv(db);
+        std::vector<std::pair<std::string, std::string>> result;
+        vordered_kv.get_snapshot(vordered_kv.latest(), result);
+        assert(std::filesystem::file_size(db) < before);
+        assert(vordered_kv.latest() == 3 && result.size() == N / 2 + 1);
+        for (int i = 1; i < N; i += 2)
+            assert(vordered_kv.find(0, key(i)) == "val" + std::to_string(i) && vordered_kv.find(3, key(i)) == (i % 10 == 1 ? "new" + std::to_string(i) : "val" + std::to_string(i)));
+        std::cout << "checked content and versions after compacting the history file from " << before << " to " << std::filesystem::file_size(db) << " bytes" << std::endl;
+        assert(vordered_kv.truncate_before(3) > 0);
+    }
+    {
+        // truncation moves the start of each log on file
+        mmap_vordered_kv_t vordered_kv(db);
+        std::vector<std::pair<int, std::string>> history;
+        vordered_kv.get_key_history(key(1), history);
+        assert(history.size() == 1 && history[0] == std::make_pair(3, std::string("new1")));
+        vordered_kv.get_key_history(key(3), history);
+        assert(history.size() == 1 && history[0] == std::make_pair(0, std::string("val3")));
+        std::cout << "checked truncated histories after reopening" << std::endl;
+    }
+
+    // a file that is not a history file is rejected, without leaking its descriptor
+    {
+        std::string junk = db + ".junk";
+        std::ofstream(junk) << "not a history file";
+        auto fds = [] {
+            return std::distance(std::filesystem::directory_iterator("/proc/self/fd"), {});
+        };
+        auto before = fds();
+        bool rejected = false;
+        try {
+            mmap_vordered_kv_t vordered_kv(junk);
+        } catch (std::runtime_error &e) {
+            rejected = true;
+        }
+        assert(rejected && fds() == before);
+        std::filesystem::remove(junk);
+        std::cout << "checked a foreign file is rejected and closed" << std::endl;
+    }
+
+    std::filesystem::remove_all(db);
+    return 0;
+}
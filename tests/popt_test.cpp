@@ -0,0 +1,94 @@
+#include "dstates/vordered_kv.hpp"
+#include "dstates/marker.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+
+using popt_vordered_kv_t = vordered_kv_t<int, int, pmem_history_t<int, int, popt_history_t<int>>>;
+
+static const int marker = marker_t<int>::low_marker;
+static const int N = 40; // past the 16 inline entries, into overflow segments 0 and 1
+
+void check_history(popt_vordered_kv_t &vordered_kv, int first) {
+    for (int v = first; v < N; v++)
+        assert(vordered_kv.find(v, 1) == v * 10);
+    assert(vordered_kv.find(N, 2) == 5 && vordered_kv.find(N, 3) == marker);
+    std::vector<std::pair<int, int>> key_result;
+    vordered_kv.get_key_history(1, key_result);
+    assert((int)key_result.size() == N - first);
+    for (int i = 0; i < (int)key_result.size(); i++)
+        assert(key_result[i].first == first + i && key_result[i].second == (first + i) * 10);
+    vordered_kv.get_key_history(1, 14, 33, key_result);
+    assert(key_result.size() == 20 && key_result.front().first == 14 && key_result.back().first == 33);
+}
+
+int main() {
+    std::string db = "/dev/shm/popt_test.db";
+    std::filesystem::remove_all(db);
+
+    {
+        popt_vordered_kv_t vordered_kv(db);
+        vordered_kv.insert(2, 5);
+        vordered_kv.insert(3, 7);
+        for (int v = 0; v < N; v++) {
+            vordered_kv.insert(1, v * 10);
+            vordered_kv.tag();
+        }
+        vordered_kv.remove(3);
+        vordered_kv.tag();
+        check_history(vordered_kv, 0);
+        std::cout << "inserted " << N << " versions of key 1, spanning the inline entries and two overflow segments" << std::endl;
+    }
+    {
+        popt_vordered_kv_t vordered_kv(db);
+        check_history(vordered_kv, 0);
+        std::cout << "checked find and key history of key 1 after reopening" << std::endl;
+        assert(vordered_kv.truncate_before(10) == 10);
+        check_history(vordered_kv, 10);
+        std::cout << "checked truncating before version 10 keeps versions 10 to " << N - 1 << std::endl;
+    }
+    {
+        popt_vordered_kv_t vordered_kv(db);
+        check_history(vordered_kv, 10);
+        std::cout << "checked truncated history of key 1 after reopening" << std::endl;
+    }
+    {
+        // readers at versions at or after the watermark race with the truncation of a history without overflow
+        popt_vordered_kv_t vordered_kv(db);
+        version_t base = vordered_kv.latest();
+        for (int i = 0; i < 12; i++) {
+            vordered_kv.insert(4, i);
+            vordered_kv.tag();
+        }
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 4; r++)
+            readers.emplace_back([&] {
+                while (!done.load())
+                    for (int i = 8; i < 12; i++)
+                        assert(vordered_kv.find(base + i, 4) == i);
+            });
+        for (int i = 1; i <= 8; i++)
+            vordered_kv.truncate_before(base + i);
+        done.store(true);
+        for (auto &r : readers)
+            r.join();
+        std::vector<std::pair<int, int>> key_result;
+        vordered_kv.get_key_history(4, key_result);
+        assert(key_result.size() == 4 && key_result.front().second == 8 && key_result.back().second == 11);
+        std::cout << "checked concurrent finds see no half-truncated inline history of key 4" << std::endl;
+    }
+    bool rejected = false;
+    try {
+        vordered_kv_t<int, int> vordered_kv(db);
+    } catch (std::runtime_error &e) {
+        rejected = true;
+    }
+    assert(rejected);
+    std::cout << "checked a popt pool is not opened with pkey histories" << std::endl;
+
+    return 0;
+}
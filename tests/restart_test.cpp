@@ -0,0 +1,147 @@
+#include "dstates/vordered_kv.hpp"
+#include "dstates/marker.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+
+using str_vordered_kv_t = vordered_kv_t<std::string, std::string>;
+
+static const std::string marker = marker_t<std::string>::low_marker;
+static const int N = 5000; // spans several key chain blocks
+
+static std::string key(int i) {
+    return "key" + std::to_string(i);
+}
+
+void check_content(str_vordered_kv_t &vordered_kv) {
+    for (int i = 0; i < N; i++) {
+        assert(vordered_kv.find(0, key(i)) == "val" + std::to_string(i));
+        assert(vordered_kv.find(1, key(i)) == (i % 2 == 0 ? marker : "val" + std::to_string(i)));
+    }
+    std::vector<std::pair<std::string, std::string>> result;
+    vordered_kv.get_snapshot(1, result);
+    assert(result.size() == N / 2);
+    for (size_t i = 1; i < result.size(); i++)
+        assert(result[i - 1].first < result[i].first);
+}
+
+int main() {
+    std::string db = "/dev/shm/restart_test.db";
+    std::filesystem::remove_all(db);
+
+    {
+        str_vordered_kv_t vordered_kv(db, true);
+        for (int i = 0; i < N; i++)
+            vordered_kv.insert(key(i), "val" + std::to_string(i));
+        vordered_kv.tag();
+        for (int i = 0; i < N; i += 2)
+            vordered_kv.remove(key(i));
+        vordered_kv.tag();
+        check_content(vordered_kv);
+        std::cout << "inserted " << N << " keys at version 0, removed every second one at version 1" << std::endl;
+    }
+    {
+        str_vordered_kv_t vordered_kv(db);
+        check_content(vordered_kv);
+        std::cout << "checked content after reopening from the index image" << std::endl;
+    }
+    {
+        str_vordered_kv_t vordered_kv(db);
+        check_content(vordered_kv);
+        std::cout << "checked content after reopening without an index image" << std::endl;
+    }
+
+    {
+        str_vordered_kv_t vordered_kv(db, false, true);
+        // answered from the key chain or the index, depending on how far the background restore got
+        for (int i = 1; i < N; i += 500)
+            assert(vordered_kv.find(1, key(i)) == "val" + std::to_string(i));
+        assert(vordered_kv.find(1, "missing") == marker);
+        check_content(vordered_kv);
+        std::cout << "checked content while and after restoring in the background" << std::endl;
+    }
+    {
+        // lookups before restore() go through the side index of the provider
+        pmem_history_t<std::string, std::string> history(db);
+        assert(history.lookup("missing") == nullptr);
+        for (int i = N - 1; i >= 0; i -= 7)
+            assert(history.lookup(key(i)) != nullptr && history.lookup(key(i))->find(0) == "val" + std::to_string(i));
+        std::cout << "checked key chain lookups of the history provider" << std::endl;
+    }
+
+    std::filesystem::remove_all(db);
+    std::vector<std::pair<std::string, std::string>> sorted;
+    for (int i = 0; i < N; i++)
+        sorted.emplace_back(key(i), "val" + std::to_string(i));
+    std::sort(sorted.begin(), sorted.end());
+    {
+        str_vordered_kv_t vordered_kv(db);
+        assert(vordered_kv.bulk_load(sorted.begin(), sorted.end()) == N);
+        vordered_kv.tag();
+        for (int i = 0; i < N; i += 2)
+            vordered_kv.remove(key(i));
+        vordered_kv.tag();
+        check_content(vordered_kv);
+        std::cout << "bulk loaded " << N << " keys at version 0, removed every second one at version 1" << std::endl;
+    }
+    {
+        str_vordered_kv_t vordered_kv(db);
+        check_content(vordered_kv);
+        bool thrown = false;
+        try {
+            vordered_kv.bulk_load(sorted.begin(), sorted.end());
+        } catch (std::runtime_error &) {
+            thrown = true;
+        }
+        assert(thrown);
+        std::cout << "checked content of the bulk loaded store after reopening" << std::endl;
+    }
+
+    // the pool is created from the poolset on first use and opened through it afterwards
+    std::string set = "/dev/shm/restart_test.set", part = "/dev/shm/restart_test.part";
+    std::filesystem::remove_all(part);
+    std::ofstream(set) << "PMEMPOOLSET\n256M " << part << "\n";
+    {
+        str_vordered_kv_t vordered_kv(set);
+        assert(vordered_kv.bulk_load(sorted.begin(), sorted.end()) == N);
+        vordered_kv.tag();
+        for (int i = 0; i < N; i += 2)
+            vordered_kv.remove(key(i));
+        vordered_kv.tag();
+    }
+    {
+        str_vordered_kv_t vordered_kv(set);
+        check_content(vordered_kv);
+        std::cout << "checked content of a store created from a poolset after reopening" << std::endl;
+    }
+    std::filesystem::remove_all(set);
+    std::filesystem::remove_all(part);
+
+    // a directory part starts with one heap granule (128M by default) and grows on demand up to its size,
+    // write past the first granule
+    std::string dir = "/dev/shm/restart_test.dir/";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+    std::ofstream(set) << "PMEMPOOLSET\nOPTION SINGLEHDR\n1G " << dir << "\n";
+    const int M = 2500;
+    const std::string large(64 << 10, 'x'); // M * 64K = 160M
+    {
+        str_vordered_kv_t vordered_kv(set);
+        for (int i = 0; i < M; i++)
+            vordered_kv.insert(key(i), large + std::to_string(i));
+        vordered_kv.tag();
+    }
+    {
+        str_vordered_kv_t vordered_kv(set);
+        for (int i = 0; i < M; i++)
+            assert(vordered_kv.find(0, key(i)) == large + std::to_string(i));
+        std::cout << "checked " << M << " values of 64K written past the first granule of a growing poolset" << std::endl;
+    }
+    std::filesystem::remove_all(set);
+    std::filesystem::remove_all(dir);
+
+    return 0;
+}
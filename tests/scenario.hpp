@@ -0,0 +1,215 @@
+#ifndef __SCENARIO
+#define __SCENARIO
+
+#include "dstates/vordered_kv.hpp"
+#include "dstates/marker.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <filesystem>
+
+// the int_test/emem_test scenario, run against a fresh store at db backed by the history provider P:
+// int_test covers the PMDK providers, emem_test the ephemeral and file-backed ones
+
+static const int marker = marker_t<int>::low_marker;
+
+template<class T> void print_content(const T &map) {
+    std::cout << "Result: ";
+    for (auto &e: map)
+	std::cout << "(" << e.first << ", " << e.second << ") ";
+    std::cout << std::endl;
+}
+
+template<class P> void run_scenario(const std::string &db) {
+    typedef vordered_kv_t<int, int, P> int_vordered_kv_t;
+
+    std::filesystem::remove_all(db);
+    int_vordered_kv_t vordered_kv(db);
+
+    vordered_kv.insert(1, 4);
+    vordered_kv.tag();
+    std::cout << "inserted (1, 4) at version 0" << std::endl;
+    vordered_kv.insert(2, 3);
+    vordered_kv.tag();
+    std::cout << "inserted (2, 3) at version 1" << std::endl;
+    vordered_kv.insert(1, 2);
+    vordered_kv.tag();
+    std::cout << "inserted (1, 2) at version 2" << std::endl;
+    vordered_kv.insert(3, 1);
+    vordered_kv.insert(1, 7);
+    vordered_kv.insert(3, 2);
+    vordered_kv.tag();
+    std::cout << "inserted (3, 1) (1, 7) (3, 2) at version 3" << std::endl;
+
+    assert(vordered_kv.find(0, 1) == 4);
+    std::cout << "checked (1, 4) can be found at version 0" << std::endl;
+    assert(vordered_kv.find(2, 3) == marker);
+    std::cout << "checked 3 cannot be found at version 2" << std::endl;
+    assert(vordered_kv.find(3, 3) == 2);
+    std::cout << "checked (3, 2) can be found at version 3" << std::endl;
+
+    std::vector<std::pair<int, int>> result;
+    vordered_kv.get_snapshot(std::numeric_limits<int>::max(), result);
+    print_content(result);
+    assert(result.size() == 3);
+    std::cout << "checked latest snapshot (version 3) has 3 entries" << std::endl;
+
+    size_t streamed = 0;
+    vordered_kv.visit_snapshot(std::numeric_limits<int>::max(), [&](const int &key, const int &val) {
+        assert(result[streamed].first == key && result[streamed].second == val);
+        streamed++;
+    });
+    assert(streamed == result.size());
+    std::cout << "checked streamed snapshot matches latest snapshot" << std::endl;
+
+    vordered_kv.get_range(2, 2, 4, result);
+    print_content(result);
+    assert(result.size() == 1);
+    std::cout << "checked range [2, 4) at version 2 has 1 entry" << std::endl;
+
+    std::vector<std::pair<int, int>> key_result;
+    vordered_kv.get_key_history(1, key_result);
+    print_content(key_result);
+    assert(key_result.size() == 3);
+    std::cout << "checked key history of 1 has 3 entries" << std::endl;
+
+    vordered_kv.get_key_history(1, 1, 2, key_result);
+    assert(key_result.size() == 1 && key_result[0].first == 2);
+    vordered_kv.get_key_history(1, 2, 3, key_result);
+    assert(key_result.size() == 2 && key_result[1].first == 3);
+    vordered_kv.get_key_history(1, 4, 10, key_result);
+    assert(key_result.empty());
+    std::cout << "checked key history of 1 restricted to versions [1, 2], [2, 3] and [4, 10]" << std::endl;
+
+    // every provider keeps the newest entry at or below the watermark and drops the older ones
+    assert(vordered_kv.truncate_before(2) == 1);
+    vordered_kv.get_key_history(1, key_result);
+    assert(key_result.size() == 2 && key_result[0].first == 2);
+    assert(vordered_kv.find(2, 1) == 2 && vordered_kv.find(3, 1) == 7);
+    std::cout << "checked truncating before version 2 keeps versions 2 and 3 of key 1" << std::endl;
+
+    write_batch_t<int, int> batch;
+    batch.insert(4, 1);
+    batch.insert(5, 1);
+    batch.remove(3);
+    assert(vordered_kv.write_batch(batch) == 5 && vordered_kv.latest() == 5);
+    assert(batch.begin()->first == 4); // applied from a sorted copy
+    vordered_kv.get_snapshot(5, result);
+    print_content(result);
+    assert(result.size() == 4 && vordered_kv.find(4, 3) == 2 && vordered_kv.find(5, 3) == marker);
+    assert(vordered_kv.find(4, 4) == marker);
+    std::cout << "checked batch (4, 1) (5, 1) remove 3 is staged at version 5, after the open version 4" << std::endl;
+
+    std::vector<std::tuple<int, int, int>> changes;
+    vordered_kv.get_changes(4, 5, changes);
+    assert(changes.size() == 3 && changes[0] == std::make_tuple(3, 2, marker));
+    assert(changes[1] == std::make_tuple(4, marker, 1) && changes[2] == std::make_tuple(5, marker, 1));
+    vordered_kv.get_changes(5, 5, changes);
+    assert(changes.empty());
+    std::cout << "checked changes between version 4 and 5 are the batch updates" << std::endl;
+
+    // a tombstone at the watermark is kept like any other entry
+    vordered_kv.truncate_before(5);
+    vordered_kv.get_key_history(3, key_result);
+    assert(key_result.size() == 1 && key_result[0] == std::make_pair(5, marker) && vordered_kv.find(5, 3) == marker);
+    vordered_kv.get_key_history(1, key_result);
+    assert(key_result.size() == 1 && key_result[0] == std::make_pair(3, 7));
+    std::cout << "checked truncating before version 5 keeps the tombstone of 3" << std::endl;
+
+    vordered_kv.remove(2);
+    vordered_kv.tag();
+    std::cout << "removed 2 at version 5" << std::endl;
+    assert(vordered_kv.reclaim(vordered_kv.latest()) == 2);
+    vordered_kv.get_snapshot(vordered_kv.latest(), result);
+    assert(result.size() == 3 && vordered_kv.find(vordered_kv.latest(), 2) == marker);
+    std::cout << "checked 2 and 3 are reclaimed below watermark " << vordered_kv.latest() << std::endl;
+    vordered_kv.insert(2, 5);
+    assert(vordered_kv.find(vordered_kv.latest(), 2) == 5);
+    std::cout << "checked (2, 5) can be inserted again after reclaim" << std::endl;
+
+    // a scrub points the shortcut of 10 to 11 on level 0, removing 11 and 12 makes it stale
+    for (int i = 10; i < 14; i++)
+        vordered_kv.insert(i, i);
+    vordered_kv.tag();
+    vordered_kv.scrub();
+    assert(vordered_kv.stats(true).stale_shortcuts == 0);
+    vordered_kv.remove(11);
+    vordered_kv.remove(12);
+    assert(vordered_kv.stats(true).stale_shortcuts >= 1);
+    int steps = 1;
+    while (!vordered_kv.scrub_step(2))
+        steps++;
+    assert(steps > 1 && vordered_kv.find(vordered_kv.latest(), 2) == 5 && vordered_kv.find(vordered_kv.latest(), 13) == 13);
+    assert(vordered_kv.stats(true).stale_shortcuts == 0);
+    std::cout << "checked incremental scrub in " << steps << " steps repairs the stale shortcuts" << std::endl;
+
+    // the removal below is the one tombstone that triggers the next pass
+    vordered_kv.clear_stats();
+    vordered_kv.start_maintainer(2, 1, std::chrono::milliseconds(1));
+    vordered_kv.remove(13);
+    while (vordered_kv.stats().scrub_passes == 0)
+        std::this_thread::yield();
+    vordered_kv.stop_maintainer();
+    assert(vordered_kv.stats(true).stale_shortcuts == 0 && vordered_kv.find(vordered_kv.latest(), 10) == 10);
+    vordered_kv.remove(10);
+    vordered_kv.tag();
+    assert(vordered_kv.reclaim(vordered_kv.latest()) == 4);
+    std::cout << "checked a background pass triggered by a tombstone leaves no stale shortcut" << std::endl;
+
+    vordered_kv.clear_stats();
+    vordered_kv.insert(6, 1);
+    vordered_kv.remove(6);
+    for (int i = 0; i < 3; i++)
+        vordered_kv.find(vordered_kv.latest(), i);
+    stats_t stats = vordered_kv.stats();
+    assert(stats.inserts == 1 && stats.removes == 1 && stats.finds == 3 && stats.history_writes == 2);
+    assert(stats.searches >= 5 && stats.keys == 0 && stats.max_history == 0);
+    stats = vordered_kv.stats(true);
+    assert(stats.finds == 3 && stats.keys == 5 && stats.max_history >= 1);
+    assert(vordered_kv.get_stats(true).find("\"finds\": 3") != std::string::npos);
+    std::cout << "stats: " << vordered_kv.get_stats(false, true) << std::endl;
+
+    // interleaved disjoint keys make the level 0 CAS of concurrent inserts fail and retry
+    std::filesystem::remove_all(db + ".con");
+    {
+        int_vordered_kv_t con_kv(db + ".con");
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 8; t++)
+            writers.emplace_back([&, t] {
+                for (int i = 0; i < 2000; i++)
+                    con_kv.insert(i * 8 + t, i);
+            });
+        for (auto &w : writers)
+            w.join();
+        for (int i = 0; i < 16000; i++) {
+            con_kv.get_key_history(i, key_result);
+            assert(key_result.size() == 1 && key_result[0].second == i / 8);
+        }
+        assert(con_kv.stats().history_writes == 16000);
+        std::cout << "checked concurrent inserts of 16000 disjoint keys leave one history entry and write each" << std::endl;
+    }
+    std::filesystem::remove_all(db + ".con");
+
+    // enough keys for partition() to find towers for several segments
+    std::filesystem::remove_all(db + ".par");
+    {
+        int_vordered_kv_t large_kv(db + ".par");
+        for (int i = 0; i < 5000; i++)
+            large_kv.insert(i * 7 % 5000, i);
+        large_kv.tag();
+        for (int i = 0; i < 5000; i += 3)
+            large_kv.remove(i);
+        large_kv.get_snapshot(0, result);
+        for (int threads : {2, 4, 7}) {
+            std::vector<std::pair<int, int>> par_result;
+            large_kv.get_snapshot(0, par_result, threads);
+            assert(par_result == result);
+            large_kv.get_snapshot(1, par_result, threads);
+            assert(par_result.size() == 5000 - 1667);
+        }
+        std::cout << "checked parallel snapshots of 5000 keys match the serial one" << std::endl;
+    }
+    std::filesystem::remove_all(db + ".par");
+}
+
+#endif // __SCENARIO
@@ -0,0 +1,122 @@
+#include "dstates/sharded_kv.hpp"
+#include "dstates/marker.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <thread>
+#include <filesystem>
+
+using int_sharded_kv_t = sharded_kv_t<int, int>;
+
+static const int marker = marker_t<int>::low_marker;
+static const int N = 3000;
+
+int main() {
+    std::vector<std::string> dbs = {"/dev/shm/sharded_test0.db", "/dev/shm/sharded_test1.db", "/dev/shm/sharded_test2.db"};
+    for (auto &db : dbs)
+        std::filesystem::remove_all(db);
+
+    {
+        int_sharded_kv_t kv(dbs, {N / 3, 2 * N / 3});
+        for (int i = 0; i < N; i++)
+            kv.insert(i, i);
+        assert(kv.tag() == 0 && kv.tag() == 1);
+        // removed at version 2 on every shard, version 1 stays untouched
+        for (int i = 0; i < N; i += 100)
+            kv.remove(i);
+        assert(kv.latest() == 2);
+
+        for (int i = 0; i < N; i++) {
+            assert(kv.find(1, i) == i);
+            assert(kv.find(2, i) == (i % 100 == 0 ? marker : i));
+        }
+        std::vector<std::pair<int, int>> result;
+        kv.get_snapshot(2, result, 4);
+        assert((int)result.size() == N - N / 100);
+        for (size_t i = 1; i < result.size(); i++)
+            assert(result[i - 1].first < result[i].first);
+        // fewer threads than shards split the shards instead of each shard
+        std::vector<std::pair<int, int>> split_result;
+        kv.get_snapshot(2, split_result, 2);
+        assert(split_result == result);
+        kv.get_range(0, N / 3 - 5, 2 * N / 3 + 5, result);
+        assert((int)result.size() == N / 3 + 10 && result.front().first == N / 3 - 5);
+        std::vector<std::tuple<int, int, int>> changes;
+        kv.get_changes(1, 2, changes);
+        assert((int)changes.size() == N / 100);
+
+        // a batch within one shard is applied at the next version, one spanning two shards is rejected
+        write_batch_t<int, int> batch;
+        batch.insert(N / 3 + 1, -1);
+        batch.insert(N / 3 + 2, -1);
+        assert(kv.write_batch(batch) == 3 && kv.find(3, N / 3 + 1) == -1 && kv.find(2, N / 3 + 1) == N / 3 + 1);
+        batch.insert(N / 3 - 1, -1);
+        bool rejected = false;
+        try {
+            kv.write_batch(batch);
+        } catch (std::invalid_argument &e) {
+            rejected = true;
+        }
+        assert(rejected && kv.latest() == 3 && kv.find(4, N / 3 - 1) == N / 3 - 1);
+        std::cout << "inserted " << N << " keys over " << kv.size() << " shards, removed every 100th one, wrote a batch to one shard" << std::endl;
+    }
+    {
+        int_sharded_kv_t kv(dbs, {N / 3, 2 * N / 3});
+        assert(kv.latest() == 3); // the newest version written, as for a single store
+        for (int i = 0; i < N; i++)
+            assert(kv.find(2, i) == (i % 100 == 0 ? marker : i));
+        assert(kv.find(3, N / 3 + 2) == -1);
+        std::cout << "checked content and shared version after reopening" << std::endl;
+    }
+
+    for (auto &db : dbs)
+        std::filesystem::remove_all(db);
+
+    // one writer per shard, pinned to the node of the shard's pool, writes only the keys of that shard
+    {
+        std::vector<int> topology = numa::nodes(), nodes;
+        for (size_t i = 0; i < dbs.size(); i++)
+            nodes.push_back(topology[i % topology.size()]);
+        std::vector<int> bounds = {0, N / 3, 2 * N / 3, N};
+        int_sharded_kv_t kv(dbs, {N / 3, 2 * N / 3}, false, 0, nodes);
+        std::vector<std::thread> writers;
+        std::atomic<int> local{0};
+        for (size_t i = 0; i < kv.size(); i++)
+            writers.emplace_back([&, i] {
+                // a cpuset may keep the thread off the node, the writes then go remote but stay correct
+                if (kv.bind_to_shard(i)) {
+                    auto mine = kv.local_shards();
+                    assert(std::find(mine.begin(), mine.end(), i) != mine.end());
+                    local++;
+                }
+                for (int k = bounds[i]; k < bounds[i + 1]; k++)
+                    kv.insert(k, k + 1);
+            });
+        for (auto &t : writers)
+            t.join();
+        for (int i = 0; i < N; i++)
+            assert(kv.find(0, i) == i + 1);
+        std::cout << "wrote each shard from a writer on its node, " << local << " of " << kv.size() << " pinned" << std::endl;
+    }
+
+    for (auto &db : dbs)
+        std::filesystem::remove_all(db);
+
+    // the WAL provider records tags, so the clock survives a restart even when no update follows the tags
+    {
+        sharded_kv_t<int, int, wal_history_t<int, int>> kv(dbs, {N / 3, 2 * N / 3});
+        kv.insert(1, 1);
+        kv.tag();
+        kv.tag();
+        assert(kv.latest() == 2);
+    }
+    {
+        sharded_kv_t<int, int, wal_history_t<int, int>> kv(dbs, {N / 3, 2 * N / 3});
+        assert(kv.latest() == 2 && kv.find(0, 1) == 1);
+        std::cout << "checked the shared clock of WAL-backed shards after reopening" << std::endl;
+    }
+
+    for (auto &db : dbs)
+        std::filesystem::remove_all(db);
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "dstates/vordered_kv.hpp"
+#include "dstates/snapshot_file.hpp"
+#include "dstates/marker.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+
+using str_vordered_kv_t = vordered_kv_t<std::string, std::string>;
+using str_emem_kv_t = vordered_kv_t<std::string, std::string, emem_history_t<std::string, std::string>>;
+
+static const std::string marker = marker_t<std::string>::low_marker;
+static const int N = 1000;
+
+static std::string key(int i) {
+    return "key" + std::to_string(1000000 + i);
+}
+
+int main() {
+    std::string db = "/dev/shm/snapshot_test.db", path = "/dev/shm/snapshot_test.snap";
+    std::filesystem::remove_all(db);
+    std::filesystem::remove_all(path);
+
+    {
+        str_vordered_kv_t vordered_kv(db);
+        for (int i = 0; i < N; i++)
+            vordered_kv.insert(key(i), "val" + std::to_string(i));
+        vordered_kv.tag();
+        for (int i = 0; i < N; i += 2)
+            vordered_kv.remove(key(i));
+        vordered_kv.tag();
+        assert(vordered_kv.export_snapshot(1, path) == N / 2);
+        std::cout << "exported version 1 with " << N / 2 << " keys" << std::endl;
+    }
+    {
+        snapshot_file_t<std::string, std::string> file(path);
+        assert(file.version() == 1 && file.size() == N / 2);
+        for (int i = 0; i < N; i++)
+            assert(file.find(key(i)) == (i % 2 == 0 ? marker : "val" + std::to_string(i)));
+        assert(file.find("missing") == marker && file.find("") == marker && file.find("zzz") == marker);
+        std::vector<std::pair<std::string, std::string>> result;
+        file.get_range(key(100), key(200), result);
+        assert(result.size() == 50 && result.front().first == key(101) && result.back().first == key(199));
+        size_t count = 0;
+        file.visit_all([&](std::string_view k, std::string_view v) {
+            assert(v == "val" + std::to_string(std::stoi(std::string(k.substr(3))) - 1000000));
+            count++;
+        });
+        assert(count == N / 2);
+        std::cout << "checked find, range and full reads from the mapped snapshot" << std::endl;
+    }
+    {
+        std::string bad = path + ".bad";
+        snapshot_file::header_t header;
+        std::ifstream(path, std::ios::binary).read((char *)&header, sizeof(header));
+        std::filesystem::copy_file(path, bad, std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::resize_file(bad, header.index_offset + 8);
+        bool rejected = false;
+        try {
+            snapshot_file_t<std::string, std::string> file(bad);
+        } catch (std::runtime_error &) {
+            rejected = true;
+        }
+        assert(rejected);
+        std::filesystem::copy_file(path, bad, std::filesystem::copy_options::overwrite_existing);
+        {
+            std::fstream patch(bad, std::ios::binary | std::ios::in | std::ios::out);
+            patch.seekp(header.index_offset + 8);
+            patch.write((const char *)&header.data_end, sizeof(header.data_end));
+        }
+        rejected = false;
+        try {
+            snapshot_file_t<std::string, std::string> file(bad);
+        } catch (std::runtime_error &) {
+            rejected = true;
+        }
+        assert(rejected);
+        // the length prefix of the last value points past the data
+        std::filesystem::copy_file(path, bad, std::filesystem::copy_options::overwrite_existing);
+        {
+            uint32_t len = 0x7fffffff;
+            std::fstream patch(bad, std::ios::binary | std::ios::in | std::ios::out);
+            patch.seekp(header.data_end - sizeof(uint32_t) - ("val" + std::to_string(N - 1)).size());
+            patch.write((const char *)&len, sizeof(len));
+        }
+        rejected = false;
+        try {
+            snapshot_file_t<std::string, std::string> file(bad);
+        } catch (std::runtime_error &) {
+            rejected = true;
+        }
+        assert(rejected);
+        std::filesystem::remove_all(bad);
+        rejected = false;
+        try {
+            snapshot_writer_t<std::string, std::string> writer(bad);
+            writer.append(key(2), "val2");
+            writer.append(key(1), "val1");
+        } catch (std::runtime_error &) {
+            rejected = true;
+        }
+        assert(rejected && !std::filesystem::exists(bad + ".tmp"));
+        std::cout << "checked truncated and corrupted snapshots, including a bad length prefix, and unsorted writes are rejected" << std::endl;
+    }
+    {
+        str_emem_kv_t replica(db);
+        assert(replica.import_snapshot(path) == N / 2);
+        assert(replica.latest() == 2);
+        for (int i = 0; i < N; i++) {
+            assert(replica.find(1, key(i)) == (i % 2 == 0 ? marker : "val" + std::to_string(i)));
+            assert(replica.find(0, key(i)) == marker);
+        }
+        std::vector<std::pair<std::string, std::string>> result;
+        replica.get_snapshot(1, result);
+        assert(result.size() == N / 2 && result[0] == std::make_pair(key(1), std::string("val1")));
+        std::cout << "warm started an ephemeral replica from the snapshot, queried at the source version" << std::endl;
+    }
+
+    std::filesystem::remove_all(db);
+    std::filesystem::remove_all(path);
+    return 0;
+}
@@ -51,11 +51,31 @@ int main() {
     assert(result.size() == 3);
     std::cout << "checked snapshot at version 3 has 3 entries" << std::endl;
 
+    vordered_kv.get_range(2, "key2", "key4", result);
+    print_content(result);
+    assert(result.size() == 1);
+    std::cout << "checked range [key2, key4) at version 2 has 1 entry" << std::endl;
+
+    size_t streamed = 0;
+    vordered_kv.visit_key_history("key1", [&](int ts, std::string_view val) {
+        streamed++;
+    });
+    assert(streamed == 3);
+    std::cout << "checked streamed key history of key1 has 3 entries" << std::endl;
+
     std::vector<std::pair<int, std::string>> key_result;
     vordered_kv.get_key_history("key1", key_result);
     print_content(key_result);
     assert(key_result.size() == 3);
     std::cout << "checked key history of key1 has 3 entries" << std::endl;
 
+    vordered_kv.get_key_history("key1", 1, 2, key_result);
+    assert(key_result.size() == 1 && key_result[0].first == 2);
+    vordered_kv.get_key_history("key1", 2, 3, key_result);
+    assert(key_result.size() == 2 && key_result[1].first == 3);
+    vordered_kv.get_key_history("key1", 4, 10, key_result);
+    assert(key_result.empty());
+    std::cout << "checked key history of key1 restricted to versions [1, 2], [2, 3] and [4, 10]" << std::endl;
+
     return 0;
 }
@@ -0,0 +1,121 @@
+#include "dstates/vordered_kv.hpp"
+#include "dstates/marker.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+
+using wal_vordered_kv_t = vordered_kv_t<int, int, wal_history_t<int, int>>;
+
+// a WAL whose group commits fail on demand, as they would on a full disk
+template <typename K, typename V> struct failing_wal_t : public wal_history_t<K, V> {
+    inline static bool fail = false;
+    using wal_history_t<K, V>::wal_history_t;
+    void commit(const std::vector<char> &payload) override {
+	if (fail)
+	    throw std::runtime_error("commit failed");
+	wal_history_t<K, V>::commit(payload);
+    }
+};
+
+static const int marker = marker_t<int>::low_marker;
+static const int N = 4000, THREADS = 8;
+
+int main() {
+    std::string db = "/dev/shm/wal_test.db";
+    std::filesystem::remove_all(db);
+
+    {
+        wal_vordered_kv_t vordered_kv(db);
+        #pragma omp parallel for num_threads(THREADS)
+        for (int i = 0; i < N; i++)
+            vordered_kv.insert(i, i);
+        vordered_kv.tag();
+        #pragma omp parallel for num_threads(THREADS)
+        for (int i = 0; i < N; i += 2)
+            vordered_kv.remove(i);
+        vordered_kv.tag();
+        vordered_kv.tag();
+        long syncs = vordered_kv.stats().pool_transactions;
+        assert(syncs > 0);
+        std::cout << "inserted " << N << " keys and removed half of them with " << syncs << " syncs" << std::endl;
+    }
+    // a record torn by a crash is cut off on the next open
+    std::ofstream(db, std::ios::app | std::ios::binary) << "torn";
+    {
+        wal_vordered_kv_t vordered_kv(db);
+        assert(vordered_kv.latest() == 3);
+        for (int i = 0; i < N; i++) {
+            assert(vordered_kv.find(0, i) == i);
+            assert(vordered_kv.find(1, i) == (i % 2 == 0 ? marker : i));
+        }
+        vordered_kv.insert(N, N);
+        std::cout << "checked content and clock after replaying the WAL" << std::endl;
+    }
+    {
+        wal_vordered_kv_t vordered_kv(db);
+        assert(vordered_kv.find(3, N) == N && vordered_kv.find(2, N) == marker);
+        std::cout << "checked records appended after a torn tail" << std::endl;
+        assert(vordered_kv.reclaim(vordered_kv.latest()) == N / 2);
+    }
+    // most of the log belongs to reclaimed keys now, the next open checkpoints it
+    size_t before = std::filesystem::file_size(db);
+    {
+        wal_vordered_kv_t vordered_kv(db);
+        assert(std::filesystem::file_size(db) < before && vordered_kv.latest() == 3);
+        vordered_kv.insert(N + 1, 1);
+    }
+    {
+        wal_vordered_kv_t vordered_kv(db);
+        for (int i = 0; i < N; i++)
+            assert(vordered_kv.find(1, i) == (i % 2 == 0 ? marker : i));
+        assert(vordered_kv.find(3, N) == N && vordered_kv.find(3, N + 1) == 1);
+        std::cout << "checked content after checkpointing the WAL from " << before << " to " << std::filesystem::file_size(db) << " bytes" << std::endl;
+    }
+
+    std::filesystem::remove_all(db);
+    {
+        vordered_kv_t<int, int, failing_wal_t<int, int>> vordered_kv(db);
+        for (int i = 0; i < 10; i++)
+            vordered_kv.insert(i, i);
+        vordered_kv.tag();
+        write_batch_t<int, int> batch;
+        batch.insert(1, 100);
+        batch.remove(2);
+        batch.insert(20, 20);
+        failing_wal_t<int, int>::fail = true;
+        bool failed = false;
+        try {
+            vordered_kv.write_batch(batch);
+        } catch (std::runtime_error &) {
+            failed = true;
+        }
+        failing_wal_t<int, int>::fail = false;
+        assert(failed && vordered_kv.latest() == 1);
+        assert(vordered_kv.find(2, 1) == 1 && vordered_kv.find(2, 2) == 2 && vordered_kv.find(2, 20) == marker);
+        vordered_kv.insert(3, 30);
+        assert(vordered_kv.find(1, 3) == 30);
+        assert(vordered_kv.write_batch(batch) == 2 && vordered_kv.find(2, 1) == 100 && vordered_kv.find(2, 20) == 20);
+        std::cout << "checked a batch whose commit fails leaves no trace in memory, and the retry applies it" << std::endl;
+    }
+
+    // a batch that only removes a missing key writes no entry, the clock it returned must survive a restart
+    std::filesystem::remove_all(db);
+    {
+        vordered_kv_t<int, int, wal_history_t<int, int>> vordered_kv(db);
+        vordered_kv.insert(1, 1);
+        write_batch_t<int, int> batch;
+        batch.remove(2);
+        assert(vordered_kv.write_batch(batch) == 1 && vordered_kv.latest() == 1);
+    }
+    {
+        vordered_kv_t<int, int, wal_history_t<int, int>> vordered_kv(db);
+        assert(vordered_kv.latest() == 1 && vordered_kv.find(1, 1) == 1 && vordered_kv.find(1, 2) == marker);
+        std::cout << "checked the version of a remove-only batch on a missing key after reopening" << std::endl;
+    }
+
+    std::filesystem::remove_all(db);
+    return 0;
+}